@@ -0,0 +1,120 @@
+#include "audio_backend.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "audio_backend_sink.hpp"
+#ifdef _WIN32
+#include "audio_backend_xaudio2.hpp"
+#endif
+
+
+static bool audioBackendSpecAccept(const char*& spec, const char* prefix) {
+    size_t len = strlen(prefix);
+    if (strncmp(spec, prefix, len) == 0) {
+        spec += len;
+        return true;
+    }
+    return false;
+}
+
+// free: and f32: ahead of the path, in any order
+static void audioBackendSinkOptions(const char*& spec, bool& paced, bool& as_float) {
+    paced = true;
+    as_float = false;
+    while (true) {
+        if (audioBackendSpecAccept(spec, "free:")) {
+            paced = false;
+        } else if (audioBackendSpecAccept(spec, "f32:")) {
+            as_float = true;
+        } else {
+            break;
+        }
+    }
+}
+
+AudioBackend* audioCreateBackend(const char* spec) {
+    if (!spec || *spec == '\0') {
+        return audioCreateDefaultBackend();
+    }
+#ifdef _WIN32
+    if (strcmp(spec, "xaudio2") == 0) {
+        return new AudioBackendXAudio2;
+    }
+#endif
+    if (strcmp(spec, "null") == 0) {
+        return new AudioBackendNull(true);
+    }
+    if (strcmp(spec, "null:free") == 0) {
+        return new AudioBackendNull(false);
+    }
+    bool paced = true;
+    bool as_float = false;
+    if (audioBackendSpecAccept(spec, "wav:")) {
+        audioBackendSinkOptions(spec, paced, as_float);
+        return new AudioBackendWav(spec, as_float, paced);
+    }
+    if (audioBackendSpecAccept(spec, "pipe:")) {
+        audioBackendSinkOptions(spec, paced, as_float);
+        return new AudioBackendPipe(spec, as_float, paced);
+    }
+    LOG_ERR("Unknown audio backend '" << spec << "'");
+    return 0;
+}
+
+AudioBackend* audioCreateDefaultBackend() {
+#ifdef _WIN32
+    return new AudioBackendXAudio2;
+#else
+    return new AudioBackendNull(true);
+#endif
+}
+
+static bool audioBufferingSpecInt(const char*& spec, const char* prefix, int& out) {
+    if (!audioBackendSpecAccept(spec, prefix)) {
+        return false;
+    }
+    char* end = 0;
+    long v = strtol(spec, &end, 10);
+    if (end == spec || v <= 0) {
+        return false;
+    }
+    out = (int)v;
+    spec = end;
+    return true;
+}
+
+bool audioParseBufferingConfig(const char* spec, AudioBufferingConfig& out) {
+    if (!spec || *spec == '\0') {
+        return false;
+    }
+    AudioBufferingConfig cfg;
+    const char* s = spec;
+    while (*s) {
+        if (audioBackendSpecAccept(s, "low_latency")) {
+            cfg = AudioBufferingConfig::lowLatency();
+        } else if (audioBackendSpecAccept(s, "robust")) {
+            cfg = AudioBufferingConfig::robust();
+        } else if (audioBackendSpecAccept(s, "adaptive")) {
+            cfg.adaptive = true;
+        } else if (!audioBufferingSpecInt(s, "block=", cfg.block_frames)
+            && !audioBufferingSpecInt(s, "depth=", cfg.queue_depth)
+            && !audioBufferingSpecInt(s, "max=", cfg.max_queue_depth)
+        ) {
+            LOG_ERR("Unknown audio buffering spec '" << spec << "'");
+            return false;
+        }
+        if (*s == ',') {
+            ++s;
+        } else if (*s) {
+            LOG_ERR("Unknown audio buffering spec '" << spec << "'");
+            return false;
+        }
+    }
+    if (cfg.max_queue_depth < cfg.queue_depth) {
+        cfg.max_queue_depth = cfg.queue_depth;
+    }
+    out = cfg;
+    return true;
+}
@@ -0,0 +1,145 @@
+#ifndef AUDIO_BACKEND_HPP
+#define AUDIO_BACKEND_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "../log/log.hpp"
+
+// Implemented by the mixer. Backends call render() from their own thread
+// whenever they need the next block of interleaved float frames
+class AudioRenderCallback {
+public:
+    virtual ~AudioRenderCallback() {}
+
+    virtual void render(float* dst, size_t frame_count) = 0;
+};
+
+// Output latency vs. robustness. Latency is about
+// block_frames * queue_depth / sample rate; more queued blocks ride
+// out longer scheduling hiccups before the device runs dry
+struct AudioBufferingConfig {
+    int  block_frames = 128;    // mixed per render() chunk and per device buffer
+    int  queue_depth = 2;       // blocks handed to the device ahead of playback
+    bool adaptive = false;      // grow the queue on underruns, shrink it back when stable
+    int  max_queue_depth = 8;
+
+    // ~5 ms at 48k
+    static AudioBufferingConfig lowLatency() {
+        AudioBufferingConfig c;
+        c.block_frames = 128;
+        c.queue_depth = 2;
+        return c;
+    }
+    // ~40 ms at 48k to start with, more if the machine keeps underrunning
+    static AudioBufferingConfig robust() {
+        AudioBufferingConfig c;
+        c.block_frames = 480;
+        c.queue_depth = 4;
+        c.adaptive = true;
+        c.max_queue_depth = 12;
+        return c;
+    }
+};
+
+// Tracks underruns and, in adaptive mode, the current queue depth.
+// Owned by a backend, updated from its audio thread only
+class AudioQueueTuner {
+    AudioBufferingConfig cfg;
+    std::atomic<int>      depth{ 2 };
+    std::atomic<uint64_t> underruns{ 0 };
+    int stable_blocks = 0;
+    int stable_needed = 0;
+public:
+    void init(const AudioBufferingConfig& cfg, int sampleRate) {
+        this->cfg = cfg;
+        depth = cfg.queue_depth;
+        underruns = 0;
+        stable_blocks = 0;
+        // One step back down per 30 seconds without a dropout
+        stable_needed = sampleRate * 30 / cfg.block_frames;
+    }
+    int      getDepth() const { return depth; }
+    uint64_t getUnderrunCount() const { return underruns; }
+
+    // Both return true if the depth changed
+    bool onUnderrun() {
+        ++underruns;
+        stable_blocks = 0;
+        if (!cfg.adaptive || depth >= cfg.max_queue_depth) {
+            return false;
+        }
+        ++depth;
+        LOG_WARN("Audio underrun, queue depth raised to " << depth);
+        return true;
+    }
+    bool onBlock() {
+        if (!cfg.adaptive || depth <= cfg.queue_depth) {
+            return false;
+        }
+        if (++stable_blocks < stable_needed) {
+            return false;
+        }
+        stable_blocks = 0;
+        --depth;
+        LOG("Audio output stable, queue depth lowered to " << depth);
+        return true;
+    }
+};
+
+// Audio output. Owns the thread (or device callback) that pulls
+// blocks from the mixing core and sends them somewhere
+class AudioBackend {
+protected:
+    AudioQueueTuner queue;
+public:
+    virtual ~AudioBackend() {}
+
+    virtual bool init(int sampleRate, int nChannels, const AudioBufferingConfig& buffering, AudioRenderCallback* cb) = 0;
+    virtual void cleanup() = 0;
+
+    virtual const char* getName() const = 0;
+
+    int      getQueueDepth() const { return queue.getDepth(); }
+    uint64_t getUnderrunCount() const { return queue.getUnderrunCount(); }
+};
+
+// Nothing pulls blocks on its own, whoever owns the mixer calls
+// render() directly. For offline renders and benchmarks
+class AudioBackendManual : public AudioBackend {
+public:
+    bool init(int sampleRate, int, const AudioBufferingConfig& buffering, AudioRenderCallback*) override {
+        queue.init(buffering, sampleRate);
+        return true;
+    }
+    void cleanup() override {}
+
+    const char* getName() const override { return "manual"; }
+};
+
+// spec examples:
+//  "xaudio2"           - default device (windows only)
+//  "null"              - discard output, paced in real time
+//  "null:free"         - discard output, render as fast as possible
+//  "wav:out.wav"       - write to a wav file in real time
+//  "wav:free:out.wav"  - write to a wav file as fast as possible
+//  "wav:f32:out.wav"   - 32 bit float wav instead of dithered 16 bit
+//  "pipe:-"            - raw s16le (dithered) to stdout, console output goes to stderr
+//  "pipe:/tmp/fifo"    - raw s16le to a file or fifo
+//  "pipe:f32:-"        - raw f32le to stdout
+//  "pipe:free:-"       - as fast as the reader takes it, for offline encodes
+// free: and f32: go in any order, for wav: and pipe: alike
+// Returns 0 if the spec is not recognized
+AudioBackend* audioCreateBackend(const char* spec);
+AudioBackend* audioCreateDefaultBackend();
+
+// spec examples:
+//  "low_latency", "robust"     - presets
+//  "block=256,depth=3"         - explicit, unset fields keep the defaults
+//  "robust,depth=6,max=16"     - preset with overrides
+//  "adaptive"                  - flag, can be combined with the above
+// Returns false (and leaves out untouched) if the spec is not recognized
+bool audioParseBufferingConfig(const char* spec, AudioBufferingConfig& out);
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef AUDIO_BACKEND_SINK_HPP
+#define AUDIO_BACKEND_SINK_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "../log/log.hpp"
+#include "audio_backend.hpp"
+#include "audio_simd.hpp"
+
+// Base for backends that are not driven by a device.
+// Runs its own thread that pulls blocks from the mixer, either paced
+// to the wall clock or free-running (as fast as write() returns)
+class AudioBackendSink : public AudioBackend {
+    std::thread thread;
+    std::atomic<bool> working{ false };
+    bool paced = true;
+protected:
+    int sample_rate = 0;
+    int n_channels = 0;
+    int block_frames = 0;
+    AudioRenderCallback* callback = 0;
+
+    virtual bool open() { return true; }
+    virtual void close() {}
+    virtual void write(const float* data, size_t frame_count) = 0;
+public:
+    AudioBackendSink(bool paced)
+    : paced(paced) {}
+    // Derived sinks must call cleanup() in their own destructor,
+    // the thread calls back into write()
+    virtual ~AudioBackendSink() {}
+
+    bool isPaced() const { return paced; }
+
+    bool init(int sampleRate, int nChannels, const AudioBufferingConfig& buffering, AudioRenderCallback* cb) override {
+        sample_rate = sampleRate;
+        n_channels = nChannels;
+        block_frames = buffering.block_frames;
+        callback = cb;
+        queue.init(buffering, sampleRate);
+        if (!open()) {
+            return false;
+        }
+
+        working = true;
+        thread = std::thread([this]() {
+            typedef std::chrono::steady_clock clock_t;
+            std::vector<float> block(block_frames * n_channels);
+            const auto block_duration = std::chrono::duration_cast<clock_t::duration>(
+                std::chrono::duration<double>(block_frames / (double)sample_rate)
+            );
+            // Paced sinks run queue depth - 1 blocks ahead of the clock,
+            // that's what the reader has buffered when we stall
+            auto deadline = clock_t::now() - block_duration * (queue.getDepth() - 1);
+            while (working) {
+                callback->render(block.data(), block_frames);
+                write(block.data(), block_frames);
+                if (!paced) {
+                    continue;
+                }
+                deadline += block_duration;
+                auto now = clock_t::now();
+                if (deadline + block_duration * (queue.getDepth() - 1) < now) {
+                    // Used up the lead, don't try to catch up with
+                    // more than a fresh lead's worth of burst
+                    queue.onUnderrun();
+                    deadline = now - block_duration * (queue.getDepth() - 1);
+                    continue;
+                }
+                if (queue.onBlock()) {
+                    // One block less of lead
+                    deadline += block_duration;
+                }
+                std::this_thread::sleep_until(deadline);
+            }
+        });
+        return true;
+    }
+    void cleanup() override {
+        if (!working) {
+            return;
+        }
+        working = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+        close();
+    }
+};
+
+class AudioBackendNull : public AudioBackendSink {
+protected:
+    void write(const float*, size_t) override {}
+public:
+    AudioBackendNull(bool paced = true)
+    : AudioBackendSink(paced) {}
+    ~AudioBackendNull() {
+        cleanup();
+    }
+
+    const char* getName() const override { return "null"; }
+};
+
+// 16 bit wav, or 32 bit float with as_float.
+// The size fields are 32 bit: at 4 GiB (3.1 hours of 48k stereo
+// float, 6.2 of 16 bit) the file is closed off and the rest dropped
+class AudioBackendWav : public AudioBackendSink {
+    std::string path;
+    bool as_float = false;
+    FILE* f = 0;
+    uint32_t data_bytes = 0;
+    bool full = false;
+    std::vector<short> conv;
+    AudioDitherState dither;
+
+    void writeHeader() {
+        const uint16_t sample_size = as_float ? sizeof(float) : sizeof(short);
+        const uint32_t byte_rate = sample_rate * n_channels * sample_size;
+        const uint16_t block_align = n_channels * sample_size;
+        const uint16_t fmt_tag = as_float ? 3 : 1; // IEEE float or PCM
+        const uint16_t channels = n_channels;
+        const uint16_t bits = sample_size * 8;
+        const uint32_t fmt_sz = 16;
+        const uint32_t riff_sz = 36 + data_bytes;
+        const uint32_t rate = sample_rate;
+        fwrite("RIFF", 4, 1, f);
+        fwrite(&riff_sz, 4, 1, f);
+        fwrite("WAVEfmt ", 8, 1, f);
+        fwrite(&fmt_sz, 4, 1, f);
+        fwrite(&fmt_tag, 2, 1, f);
+        fwrite(&channels, 2, 1, f);
+        fwrite(&rate, 4, 1, f);
+        fwrite(&byte_rate, 4, 1, f);
+        fwrite(&block_align, 2, 1, f);
+        fwrite(&bits, 2, 1, f);
+        fwrite("data", 4, 1, f);
+        fwrite(&data_bytes, 4, 1, f);
+    }
+protected:
+    bool open() override {
+        f = fopen(path.c_str(), "wb");
+        if (!f) {
+            LOG_ERR("Failed to open wav output '" << path << "'");
+            return false;
+        }
+        data_bytes = 0;
+        full = false;
+        writeHeader();
+        return true;
+    }
+    void close() override {
+        if (!f) {
+            return;
+        }
+        // Patch sizes now that we know them
+        fseek(f, 0, SEEK_SET);
+        writeHeader();
+        fclose(f);
+        f = 0;
+    }
+    void write(const float* data, size_t frame_count) override {
+        size_t count = frame_count * n_channels;
+        const uint64_t bytes = count * (as_float ? sizeof(float) : sizeof(short));
+        if (full) {
+            return;
+        }
+        // riff_sz is 36 + data_bytes
+        if (data_bytes + bytes > UINT32_MAX - 36) {
+            LOG_WARN("Wav output '" << path << "' reached the 4 GiB wav limit, the rest is not written");
+            full = true;
+            return;
+        }
+        if (as_float) {
+            fwrite(data, sizeof(float), count, f);
+            data_bytes += (uint32_t)(count * sizeof(float));
+            return;
+        }
+        conv.resize(count);
+        audioMixKernels().to_s16_dither(conv.data(), data, count, dither);
+        fwrite(conv.data(), sizeof(short), count, f);
+        data_bytes += (uint32_t)(count * sizeof(short));
+    }
+public:
+    AudioBackendWav(const char* path, bool as_float = false, bool paced = true)
+    : AudioBackendSink(paced), path(path), as_float(as_float) {}
+    ~AudioBackendWav() {
+        cleanup();
+    }
+
+    const char* getName() const override { return "wav"; }
+};
+
+// Makes stdout carry nothing but what's written to the returned file.
+// The original stdout descriptor is duplicated for it and descriptor 1
+// is pointed at stderr, so the log's console copy, printf and
+// std::cout all end up on stderr instead of in the samples
+inline FILE* audioTakeStdout() {
+    fflush(stdout);
+#ifdef _WIN32
+    int fd = _dup(_fileno(stdout));
+    if (fd < 0) {
+        return 0;
+    }
+    if (_dup2(_fileno(stderr), _fileno(stdout)) != 0) {
+        _close(fd);
+        return 0;
+    }
+    _setmode(fd, _O_BINARY);
+    return _fdopen(fd, "wb");
+#else
+    int fd = dup(fileno(stdout));
+    if (fd < 0) {
+        return 0;
+    }
+    if (dup2(fileno(stderr), fileno(stdout)) < 0) {
+        ::close(fd);
+        return 0;
+    }
+    return fdopen(fd, "wb");
+#endif
+}
+
+// Raw interleaved pcm to stdout or a file/fifo, e.g. for ffmpeg or OBS.
+// Writing to stdout ("-") moves all other console output to stderr,
+// see audioTakeStdout()
+class AudioBackendPipe : public AudioBackendSink {
+    std::string path;
+    bool as_float = false;
+    FILE* f = 0;
+    std::vector<short> conv;
+    AudioDitherState dither;
+protected:
+    bool open() override {
+        if (path == "-") {
+            f = audioTakeStdout();
+        } else {
+            f = fopen(path.c_str(), "wb");
+        }
+        if (!f) {
+            LOG_ERR("Failed to open pcm output '" << path << "'");
+            return false;
+        }
+        return true;
+    }
+    void close() override {
+        if (!f) {
+            return;
+        }
+        fclose(f);
+        f = 0;
+    }
+    void write(const float* data, size_t frame_count) override {
+        size_t count = frame_count * n_channels;
+        if (as_float) {
+            fwrite(data, sizeof(float), count, f);
+        } else {
+            conv.resize(count);
+            audioMixKernels().to_s16_dither(conv.data(), data, count, dither);
+            fwrite(conv.data(), sizeof(short), count, f);
+        }
+        fflush(f);
+    }
+public:
+    AudioBackendPipe(const char* path, bool as_float = false, bool paced = true)
+    : AudioBackendSink(paced), path(path), as_float(as_float) {}
+    ~AudioBackendPipe() {
+        cleanup();
+    }
+
+    const char* getName() const override { return "pipe"; }
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef AUDIO_BACKEND_XAUDIO2_HPP
+#define AUDIO_BACKEND_XAUDIO2_HPP
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <xaudio2.h>
+#pragma comment(lib, "xaudio2.lib")
+
+#include "../log/log.hpp"
+#include "audio_backend.hpp"
+
+class AudioBackendXAudio2 : public AudioBackend, public IXAudio2VoiceCallback {
+    IXAudio2* pXAudio2 = 0;
+    IXAudio2MasteringVoice* pMasteringVoice = 0;
+    IXAudio2SourceVoice* pSourceVoice = 0;
+
+    AudioRenderCallback* callback = 0;
+    int n_channels = 2;
+    int block_frames = 0;
+
+    // Ring of max queue depth + 1 blocks, the one after the last
+    // submitted is never queued
+    std::vector<float> buffers;
+    int buffer_count = 0;
+    int next_buffer = 0;
+
+    float* nextBuffer() {
+        float* p = buffers.data() + (size_t)next_buffer * block_frames * n_channels;
+        next_buffer = (next_buffer + 1) % buffer_count;
+        return p;
+    }
+    void submit(float* data) {
+        XAUDIO2_BUFFER buf = { 0 };
+        buf.AudioBytes = (UINT32)(block_frames * n_channels * sizeof(float));
+        buf.pAudioData = (BYTE*)data;
+        buf.LoopCount = 0;
+        buf.pContext = this;
+        pSourceVoice->SubmitSourceBuffer(&buf);
+    }
+    bool createSourceVoice(int sampleRate) {
+        const int bitPerSample = 32;
+        const int blockAlign = (bitPerSample * n_channels) / 8;
+
+        WAVEFORMATEX wfx = {
+            WAVE_FORMAT_IEEE_FLOAT,
+            (WORD)n_channels,
+            (DWORD)sampleRate,
+            (DWORD)(sampleRate * blockAlign),
+            (WORD)blockAlign,
+            (WORD)bitPerSample,
+            0
+        };
+        HRESULT hr;
+        if(FAILED(hr = pXAudio2->CreateSourceVoice(&pSourceVoice, &wfx, 0, 1.0f, this)))
+        {
+            LOG_ERR("Failed to create source voice: " << hr);
+            return false;
+        }
+
+        // Starts out with queue depth blocks of silence
+        buffers.assign((size_t)buffer_count * block_frames * n_channels, .0f);
+        for (int i = 0; i < queue.getDepth(); ++i) {
+            submit(nextBuffer());
+        }
+        pSourceVoice->Start(0, 0);
+        return true;
+    }
+public:
+    ~AudioBackendXAudio2() {
+        cleanup();
+    }
+
+    const char* getName() const override { return "xaudio2"; }
+
+    bool init(int sampleRate, int nChannels, const AudioBufferingConfig& buffering, AudioRenderCallback* cb) override {
+        callback = cb;
+        n_channels = nChannels;
+        block_frames = buffering.block_frames;
+        buffer_count = std::max(buffering.max_queue_depth, buffering.queue_depth) + 1;
+        next_buffer = 0;
+        queue.init(buffering, sampleRate);
+
+        HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        if(FAILED(hr)) {
+            // NOTE: It's ok to fail here, means someone else already did it
+            //LOG_ERR("Failed to init COM: " << hr);
+            //return false;
+        }
+        #if(_WIN32_WINNT < 0x602)
+        #ifdef _DEBUG
+            HMODULE xAudioDll = LoadLibraryExW(L"XAudioD2_7.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
+        #else
+            HMODULE xAudioDll = LoadLibraryExW(L"XAudio2_7.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
+        #endif
+            if(!xAudioDll) {
+                LOG_ERR("Failed to find XAudio2.7 dll");
+                CoUninitialize();
+                return false;
+            }
+        #endif
+        UINT32 flags = 0;
+        #if (_WIN32_WINNT < 0x0602 /*_WIN32_WINNT_WIN8*/) && defined(_DEBUG)
+            flags |= XAUDIO2_DEBUG_ENGINE;
+        #endif
+
+        hr = XAudio2Create(&pXAudio2, flags);
+        if(FAILED(hr)) {
+            LOG_ERR("Failed to init XAudio2: " << hr);
+            CoUninitialize();
+            return false;
+        }
+
+        if(FAILED(hr = pXAudio2->CreateMasteringVoice(&pMasteringVoice)))
+        {
+            LOG_ERR("Failed to create mastering voice: " << hr);
+            //pXAudio2.Reset();
+            CoUninitialize();
+            return false;
+        }
+        pMasteringVoice->SetVolume(1.00f);
+
+        CoUninitialize();
+
+        return createSourceVoice(sampleRate);
+    }
+    void cleanup() override {
+        if (!pXAudio2) {
+            return;
+        }
+        pXAudio2->StopEngine();
+        pXAudio2->Release();
+        pXAudio2 = 0;
+        pMasteringVoice = 0;
+        pSourceVoice = 0;
+    }
+
+    void __stdcall OnStreamEnd() {   }
+
+    //Unused methods are stubs
+    void __stdcall OnVoiceProcessingPassEnd() { }
+    void __stdcall OnVoiceProcessingPassStart(UINT32 SamplesRequired) {    }
+    void __stdcall OnBufferEnd(void * pBufferContext) {
+        XAUDIO2_VOICE_STATE state;
+        pSourceVoice->GetState(&state, XAUDIO2_VOICE_NOSAMPLESPLAYED);
+        int queued = (int)state.BuffersQueued;
+        if (queued == 0) {
+            // Played out everything we gave it, the device got silence
+            queue.onUnderrun();
+        } else {
+            queue.onBlock();
+        }
+        // Tops up to the current depth; after the depth is lowered
+        // this submits nothing once and the queue drains by a block
+        while (queued < queue.getDepth()) {
+            float* block = nextBuffer();
+            callback->render(block, block_frames);
+            submit(block);
+            ++queued;
+        }
+    }
+    void __stdcall OnBufferStart(void * pBufferContext) {    }
+    void __stdcall OnLoopEnd(void * pBufferContext) {
+
+    }
+    void __stdcall OnVoiceError(void * pBufferContext, HRESULT Error) {
+        LOG("Voice error: " << Error);
+     }
+};
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef AUDIO_BENCH_HPP
+#define AUDIO_BENCH_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "audio_mixer.hpp"
+
+// One mixer workload: voices all playing at once for the whole run
+struct AudioBenchCase {
+    const char* name = "";
+    int  voices = 128;
+    int  channels = 2;          // of the clips, 1 or 2
+    bool is3d = false;
+    bool far = false;           // 3d emitters past their attenuation radius, low-passed
+    bool looping = false;       // short clips that wrap during the run
+    bool mixed_rates = false;   // clips at 44.1k/22.05k/32k/48k instead of the mixer rate
+    int  block_frames = 128;
+    AUDIO_RESAMPLE_QUALITY quality = AUDIO_RESAMPLE_SINC;
+    int  workers = 0;           // parallel mix helper threads
+    float reverb_seconds = .0f; // impulse response of a reverb every bus sends to, 0 for none
+};
+
+struct AudioBenchResult {
+    AudioBenchCase bench;
+    int    sample_rate = 0;
+    size_t blocks = 0;
+    double ns_per_sample_voice = .0; // per output frame, per voice
+    double block_avg_us = .0;        // render() call, commands + mix + limiter
+    double block_p99_us = .0;
+    double block_max_us = .0;
+    double deadline_us = .0;         // length of a block in real time
+    int    mix_workers = 0;          // parallel mix helper threads that ran
+};
+
+// Sine clip, slightly detuned between channels so nothing cancels out
+inline std::unique_ptr<AudioBuffer> audioBenchTone(int sampleRate, int channels, float seconds, float freq) {
+    const size_t frames = (size_t)(seconds * sampleRate);
+    std::vector<short> samples(frames * channels);
+    for (size_t i = 0; i < frames; ++i) {
+        for (int c = 0; c < channels; ++c) {
+            float f = freq * (1.0f + c * .01f);
+            samples[i * channels + c] = (short)(12000.0f * sinf(6.2831853f * f * i / sampleRate));
+        }
+    }
+    return std::unique_ptr<AudioBuffer>(new AudioBuffer(
+        samples.data(), samples.size() * sizeof(short), sampleRate, channels
+    ));
+}
+
+// Stereo room-ish impulse response: decaying noise, 60 dB down at the end
+inline std::unique_ptr<AudioBuffer> audioBenchImpulse(int sampleRate, float seconds) {
+    const size_t frames = (size_t)(seconds * sampleRate);
+    std::unique_ptr<AudioBuffer> buf(AudioBuffer::createF32(frames * 2, sampleRate, 2));
+    float* h = buf->getPtrF32();
+    uint32_t x = 0x9e3779b9;
+    const float decay = logf(.001f) / std::max<size_t>(1, frames);
+    for (size_t i = 0; i < frames * 2; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        h[i] = ((x >> 8) * (1.0f / 8388608.0f) - 1.0f) * expf(decay * (i / 2));
+    }
+    return buf;
+}
+
+// Drives a private mixer through AudioBackendManual, so nothing else
+// (device, other threads) is in the measurement. seconds is audio
+// time rendered, not wall time
+inline AudioBenchResult audioBenchRun(const AudioBenchCase& bench, float seconds = 1.0f) {
+    typedef std::chrono::steady_clock clock_t;
+    const int sample_rate = 48000;
+    const int mixed_rates[] = { 44100, 22050, 32000, 48000 };
+    const int CLIPS = 4;
+
+    std::vector<std::unique_ptr<AudioBuffer>> clips;
+    float clip_seconds = bench.looping ? .25f : seconds + 1.0f;
+    for (int i = 0; i < CLIPS; ++i) {
+        int rate = bench.mixed_rates ? mixed_rates[i] : sample_rate;
+        clips.push_back(audioBenchTone(rate, bench.channels, clip_seconds, 220.0f * (i + 1)));
+    }
+
+    // Big enough that it's better off the stack
+    std::unique_ptr<AudioMixer> mixer(new AudioMixer);
+    AudioBufferingConfig buffering;
+    buffering.block_frames = bench.block_frames;
+    mixer->init(sample_rate, 16, new AudioBackendManual, buffering);
+    // Every voice plays, the caps would otherwise steal most of them
+    AudioPolyphonyConfig polyphony;
+    polyphony.max_voices = AUDIO_MAX_VOICES;
+    for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+        polyphony.category_max[i] = AUDIO_MAX_VOICES;
+    }
+    mixer->setPolyphony(polyphony);
+    mixer->setResampleQuality(bench.quality);
+    if (bench.workers > 0) {
+        AudioParallelMixConfig parallel;
+        parallel.workers = bench.workers;
+        parallel.min_voices = 1;
+        mixer->setParallelMix(parallel);
+    }
+    if (bench.reverb_seconds > .0f) {
+        AudioReverbConfig reverb;
+        reverb.max_seconds = bench.reverb_seconds;
+        mixer->setReverb(std::shared_ptr<AudioBuffer>(audioBenchImpulse(sample_rate, bench.reverb_seconds).release()), reverb);
+        for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+            AudioBusConfig bus = mixer->getBus((AUDIO_CATEGORY)i);
+            bus.reverb_send_db = -12.0f;
+            mixer->setBus((AUDIO_CATEGORY)i, bus);
+        }
+    }
+
+    std::vector<float> block((size_t)bench.block_frames * mixer->getChannelCount());
+    // Nobody else drains the command ring, render a block every so often
+    const int VOICES_PER_PUMP = 64;
+    std::vector<Handle<AudioChannel>> channels;
+    for (int v = 0; v < bench.voices; ++v) {
+        Handle<AudioChannel> ch = mixer->createChannel();
+        mixer->setBuffer(ch, clips[v % CLIPS].get());
+        mixer->setLooping(ch, bench.looping);
+        mixer->setGain(ch, .1f);
+        if (bench.is3d) {
+            float a = v * 2.39996f;
+            float r = bench.far ? 15.0f + (v % 8) * 5.0f : 1.0f + (v % 8);
+            mixer->setPosition(ch, gfxm::vec3(cosf(a) * r, .0f, sinf(a) * r));
+            mixer->play3d(ch);
+        } else {
+            mixer->play(ch);
+        }
+        channels.push_back(ch);
+        if (v % VOICES_PER_PUMP == VOICES_PER_PUMP - 1) {
+            mixer->render(block.data(), bench.block_frames);
+        }
+    }
+    // Apply the rest and settle caches
+    for (int i = 0; i < 8; ++i) {
+        mixer->render(block.data(), bench.block_frames);
+    }
+    const int mix_workers = mixer->getParallelMixWorkers();
+
+    const size_t blocks = std::max<size_t>(1, (size_t)(seconds * sample_rate / bench.block_frames));
+    std::vector<double> times(blocks);
+    for (size_t i = 0; i < blocks; ++i) {
+        clock_t::time_point t0 = clock_t::now();
+        mixer->render(block.data(), bench.block_frames);
+        times[i] = std::chrono::duration<double, std::micro>(clock_t::now() - t0).count();
+    }
+
+    for (int v = 0; v < (int)channels.size(); ++v) {
+        mixer->freeChannel(channels[v]);
+        if (v % VOICES_PER_PUMP == VOICES_PER_PUMP - 1) {
+            mixer->render(block.data(), bench.block_frames);
+        }
+    }
+    mixer->render(block.data(), bench.block_frames);
+    mixer->update();
+    mixer->cleanup();
+
+    AudioBenchResult r;
+    r.bench = bench;
+    r.sample_rate = sample_rate;
+    r.blocks = blocks;
+    double total = .0;
+    for (double t : times) {
+        total += t;
+    }
+    std::sort(times.begin(), times.end());
+    r.block_avg_us = total / blocks;
+    r.block_p99_us = times[std::min(blocks - 1, blocks * 99 / 100)];
+    r.block_max_us = times.back();
+    r.deadline_us = bench.block_frames * 1e6 / sample_rate;
+    r.mix_workers = mix_workers;
+    r.ns_per_sample_voice = total * 1000.0 / ((double)blocks * bench.block_frames * std::max(1, bench.voices));
+    return r;
+}
+
+// Voices the mixer could keep up with in real time if a block may take
+// budget of its deadline, extrapolated from a run and an empty run
+// (fixed per-block cost) at the same block size
+inline int audioBenchMaxVoices(const AudioBenchResult& r, const AudioBenchResult& empty, float budget = .5f) {
+    double per_voice = (r.block_avg_us - empty.block_avg_us) / std::max(1, r.bench.voices);
+    if (per_voice <= .0) {
+        return AUDIO_MAX_VOICES;
+    }
+    double fits = (r.deadline_us * budget - empty.block_avg_us) / per_voice;
+    return (int)std::max(.0, fits);
+}
+
+// Every voice layout at the usual block sizes, then the reverb alone
+// (no voices, its cost per block is all there is over an empty run)
+inline std::vector<AudioBenchCase> audioBenchDefaultCases(int voices = 128) {
+    struct Layout {
+        const char* name;
+        int  channels;
+        bool is3d;
+        bool far;
+        bool looping;
+        bool mixed_rates;
+    };
+    const Layout layouts[] = {
+        { "mono 2d",          1, false, false, false, false },
+        { "stereo 2d",        2, false, false, false, false },
+        { "mono 3d",          1, true,  false, false, false },
+        { "stereo 3d",        2, true,  false, false, false },
+        { "mono 3d far",      1, true,  true,  false, false },
+        { "stereo looping",   2, false, false, true,  false },
+        { "stereo mixed rate", 2, false, false, false, true },
+        { "mono 3d loop mixed", 1, true,  false, true,  true  },
+    };
+    const int block_sizes[] = { 64, 128, 256, 512 };
+    std::vector<AudioBenchCase> cases;
+    for (int block : block_sizes) {
+        for (const Layout& l : layouts) {
+            AudioBenchCase c;
+            c.name = l.name;
+            c.voices = voices;
+            c.channels = l.channels;
+            c.is3d = l.is3d;
+            c.far = l.far;
+            c.looping = l.looping;
+            c.mixed_rates = l.mixed_rates;
+            c.block_frames = block;
+            cases.push_back(c);
+        }
+        AudioBenchCase reverb;
+        reverb.name = "reverb 2s ir";
+        reverb.voices = 0;
+        reverb.reverb_seconds = 2.0f;
+        reverb.block_frames = block;
+        cases.push_back(reverb);
+    }
+    return cases;
+}
+
+// 3d voices at mixed clip rates and the default block size, the load
+// the parallel mix is for, at counts an overlay can get to
+inline std::vector<AudioBenchCase> audioBenchParallelCases() {
+    const int counts[] = { 128, 256, 384, 512 };
+    std::vector<AudioBenchCase> cases;
+    for (int voices : counts) {
+        AudioBenchCase c;
+        c.name = "mono 3d mixed rate";
+        c.voices = voices;
+        c.channels = 1;
+        c.is3d = true;
+        c.mixed_rates = true;
+        cases.push_back(c);
+    }
+    return cases;
+}
+
+#endif
@@ -1,19 +1,73 @@
 #ifndef AUDIO_BUFFER_HPP
 #define AUDIO_BUFFER_HPP
 
+#include <memory>
 #include <vector>
 
+enum AUDIO_SAMPLE_FORMAT {
+    AUDIO_SAMPLE_S16,
+    AUDIO_SAMPLE_F32    // [-1, 1]
+};
+
+// Interleaved samples of a clip. The samples are either owned
+// (copied in, or an adopted allocation freed with its deleter)
+// or borrowed from memory that outlives the buffer (a file mapping
+// kept alive through owner, an arena, static data)
 struct AudioBuffer {
+    // Copies s16 samples, sz is in bytes
     AudioBuffer(const void* data, size_t sz, int sampleRate, int nChannels) {
         this->data = std::vector<short>((short*)data, (short*)((char*)data + sz));
+        ptr = this->data.data();
+        count = this->data.size();
         sample_rate = sampleRate;
         n_channels = nChannels;
     }
+
+    // Takes over an allocation made elsewhere (e.g. by a decoder),
+    // deleter(samples) is called when the buffer goes away
+    template<typename T, typename DELETER>
+    static AudioBuffer* adopt(T* samples, size_t sample_count, int sampleRate, int nChannels, DELETER deleter) {
+        return new AudioBuffer(
+            formatOf(samples), samples, sample_count, sampleRate, nChannels,
+            std::shared_ptr<void>(samples, deleter)
+        );
+    }
+    // Borrows samples, owner (if any) is kept alive instead.
+    // Borrowed samples may be read-only, they are never written through getPtr()
+    template<typename T>
+    static AudioBuffer* view(const T* samples, size_t sample_count, int sampleRate, int nChannels, const std::shared_ptr<void>& owner = std::shared_ptr<void>()) {
+        return new AudioBuffer(formatOf(samples), samples, sample_count, sampleRate, nChannels, owner);
+    }
+    // Owned, zeroed float storage to be filled through getPtrF32()
+    static AudioBuffer* createF32(size_t sample_count, int sampleRate, int nChannels) {
+        AudioBuffer* buf = new AudioBuffer(AUDIO_SAMPLE_F32, 0, sample_count, sampleRate, nChannels, std::shared_ptr<void>());
+        buf->data_f32.resize(sample_count);
+        buf->ptr = buf->data_f32.data();
+        return buf;
+    }
+
+    // Null unless the format is AUDIO_SAMPLE_S16
     short* getPtr() {
-        return data.data();
+        return format == AUDIO_SAMPLE_S16 ? (short*)ptr : 0;
+    }
+    // Null unless the format is AUDIO_SAMPLE_F32
+    float* getPtrF32() {
+        return format == AUDIO_SAMPLE_F32 ? (float*)ptr : 0;
+    }
+    const void* getData() const {
+        return ptr;
+    }
+    AUDIO_SAMPLE_FORMAT sampleFormat() const {
+        return format;
+    }
+    size_t sampleSize() const {
+        return format == AUDIO_SAMPLE_F32 ? sizeof(float) : sizeof(short);
     }
     size_t sampleCount() {
-        return data.size();
+        return count;
+    }
+    size_t byteSize() const {
+        return count * sampleSize();
     }
     int channelCount() {
         return n_channels;
@@ -22,7 +76,23 @@ struct AudioBuffer {
         return sample_rate;
     }
 private:
+    AudioBuffer(AUDIO_SAMPLE_FORMAT fmt, const void* samples, size_t sample_count, int sampleRate, int nChannels, const std::shared_ptr<void>& owner)
+    : owner(owner) {
+        format = fmt;
+        ptr = (void*)samples;
+        count = sample_count;
+        sample_rate = sampleRate;
+        n_channels = nChannels;
+    }
+    static AUDIO_SAMPLE_FORMAT formatOf(const short*) { return AUDIO_SAMPLE_S16; }
+    static AUDIO_SAMPLE_FORMAT formatOf(const float*) { return AUDIO_SAMPLE_F32; }
+
     std::vector<short> data;
+    std::vector<float> data_f32;
+    std::shared_ptr<void> owner;
+    AUDIO_SAMPLE_FORMAT format = AUDIO_SAMPLE_S16;
+    void* ptr = 0;
+    size_t count = 0;
     int sample_rate;
     int n_channels = 2;
 };
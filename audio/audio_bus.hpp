@@ -0,0 +1,245 @@
+#ifndef AUDIO_BUS_HPP
+#define AUDIO_BUS_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "audio_reverb.hpp"
+#include "audio_simd.hpp"
+
+// What a voice is, for polyphony limits. Every category is also a
+// submix bus the voice is mixed into
+enum AUDIO_CATEGORY {
+    AUDIO_CATEGORY_SFX,
+    AUDIO_CATEGORY_TTS,
+    AUDIO_CATEGORY_MUSIC,
+    AUDIO_CATEGORY_ALERTS,
+    AUDIO_CATEGORY_COUNT
+};
+
+inline const char* audioCategoryName(int category) {
+    static const char* names[AUDIO_CATEGORY_COUNT] = { "sfx", "tts", "music", "alerts" };
+    return category >= 0 && category < AUDIO_CATEGORY_COUNT ? names[category] : "";
+}
+// -1 if name isn't one
+inline int audioCategoryFromName(const char* name, size_t len) {
+    for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+        if (strlen(audioCategoryName(i)) == len && strncmp(audioCategoryName(i), name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Sends at or under this are off
+#define AUDIO_BUS_SEND_OFF_DB -100.0f
+
+// Fader of a bus, and how it gets out of the way of other buses:
+// while any bus in duck_sidechain (bits of 1 << category) peaks over
+// duck_threshold_db, this one is turned down by duck_db.
+// reverb_send_db is how much of it (after the fader) goes to the
+// reverb, if the mixer has one
+struct AudioBusConfig {
+    float    gain_db = .0f;
+    bool     mute = false;
+    uint32_t duck_sidechain = 0;
+    float    duck_db = -10.0f;
+    float    duck_threshold_db = -45.0f;
+    float    duck_attack_seconds = .02f;
+    float    duck_release_seconds = .5f;
+    float    reverb_send_db = AUDIO_BUS_SEND_OFF_DB;
+
+    // Music makes room for speech and alerts
+    static AudioBusConfig defaultFor(int category) {
+        AudioBusConfig cfg;
+        if (category == AUDIO_CATEGORY_MUSIC) {
+            cfg.duck_sidechain = (1u << AUDIO_CATEGORY_TTS) | (1u << AUDIO_CATEGORY_ALERTS);
+        }
+        return cfg;
+    }
+};
+
+// spec examples:
+//  "music=-6"                  - fader in dB, other buses untouched
+//  "sfx=-3,tts=+2,alerts=mute" - several buses
+//  "music=-6:duck=-14"         - with the ducking depth
+//  "sfx=0:reverb=-12"          - sent to the reverb 12 dB down
+// Returns false (and leaves out untouched) if the spec is not recognized
+inline bool audioParseBusConfig(const char* spec, AudioBusConfig (&out)[AUDIO_CATEGORY_COUNT]) {
+    if (!spec || *spec == '\0') {
+        return false;
+    }
+    AudioBusConfig cfg[AUDIO_CATEGORY_COUNT];
+    std::copy(out, out + AUDIO_CATEGORY_COUNT, cfg);
+    const char* s = spec;
+    while (*s) {
+        const char* eq = strchr(s, '=');
+        int bus = eq ? audioCategoryFromName(s, eq - s) : -1;
+        if (bus < 0) {
+            return false;
+        }
+        s = eq + 1;
+        char* end = 0;
+        if (strncmp(s, "mute", 4) == 0) {
+            cfg[bus].mute = true;
+            s += 4;
+        } else {
+            cfg[bus].gain_db = strtof(s, &end);
+            if (end == s) {
+                return false;
+            }
+            cfg[bus].mute = false;
+            s = end;
+        }
+        while (*s == ':') {
+            float* opt = 0;
+            if (strncmp(s, ":duck=", 6) == 0) {
+                s += 6;
+                opt = &cfg[bus].duck_db;
+            } else if (strncmp(s, ":reverb=", 8) == 0) {
+                s += 8;
+                opt = &cfg[bus].reverb_send_db;
+            } else {
+                return false;
+            }
+            *opt = strtof(s, &end);
+            if (end == s) {
+                return false;
+            }
+            s = end;
+        }
+        if (*s == ',') {
+            ++s;
+        } else if (*s) {
+            return false;
+        }
+    }
+    std::copy(cfg, cfg + AUDIO_CATEGORY_COUNT, out);
+    return true;
+}
+
+// One interleaved stereo block per category, back to back, that voices
+// are mixed straight into. mixdown() sums them to the master block
+// with each bus's fader and ducking, and their sends into the reverb,
+// which runs once on the sum. Gain changes ramp over a block
+class AudioBusMix {
+    int sample_rate = 48000;
+    size_t block_frames = 0;
+    std::vector<float> data;
+
+    AudioBusConfig cfg[AUDIO_CATEGORY_COUNT];
+    float fader[AUDIO_CATEGORY_COUNT];      // gain_db and mute, linear
+    float duck_gain[AUDIO_CATEGORY_COUNT];  // linear, 1 when not ducked
+    float applied[AUDIO_CATEGORY_COUNT];    // gain the last block ended on
+    float level[AUDIO_CATEGORY_COUNT];      // peak of the last block after the fader
+    float send[AUDIO_CATEGORY_COUNT];       // reverb_send_db, linear
+    float send_applied[AUDIO_CATEGORY_COUNT];
+
+    AudioConvolver* reverb = 0;
+    float reverb_return = 1.0f;
+    std::vector<float> send_block;
+public:
+    void init(int sampleRate, size_t block_frames) {
+        sample_rate = sampleRate;
+        this->block_frames = block_frames;
+        data.assign(block_frames * 2 * AUDIO_CATEGORY_COUNT, .0f);
+        send_block.assign(block_frames * 2, .0f);
+        for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+            setConfig(i, AudioBusConfig::defaultFor(i));
+            duck_gain[i] = 1.0f;
+            applied[i] = fader[i];
+            level[i] = .0f;
+            send_applied[i] = .0f;
+        }
+    }
+    void setConfig(int category, const AudioBusConfig& c) {
+        cfg[category] = c;
+        fader[category] = c.mute ? .0f : powf(10.0f, c.gain_db / 20.0f);
+        send[category] = c.reverb_send_db > AUDIO_BUS_SEND_OFF_DB ? powf(10.0f, c.reverb_send_db / 20.0f) : .0f;
+    }
+    // Owned by the caller, 0 for none. Runs every block while set,
+    // its cost doesn't depend on what the buses hold
+    void setReverb(AudioConvolver* r, float return_gain) {
+        reverb = r;
+        reverb_return = return_gain;
+    }
+    const AudioBusConfig& getConfig(int category) const { return cfg[category]; }
+    float getLevel(int category) const { return level[category]; }
+
+    float* buffer() { return data.data(); }
+    size_t size() const { return data.size(); }
+    // Samples from one bus to the next
+    size_t stride() const { return block_frames * 2; }
+
+    void clear() {
+        memset(data.data(), 0, data.size() * sizeof(float));
+    }
+
+    // Overwrites dst with frames of all buses summed
+    void mixdown(float* dst, size_t frames) {
+        const size_t n = frames * 2;
+        float peak[AUDIO_CATEGORY_COUNT];
+        for (int b = 0; b < AUDIO_CATEGORY_COUNT; ++b) {
+            peak[b] = audioPeak(data.data() + b * stride(), n);
+            level[b] = peak[b] * fader[b];
+        }
+        memset(dst, 0, n * sizeof(float));
+        if (reverb) {
+            memset(send_block.data(), 0, n * sizeof(float));
+        }
+        for (int b = 0; b < AUDIO_CATEGORY_COUNT; ++b) {
+            updateDucking(b, frames);
+            const float target = fader[b] * duck_gain[b];
+            const float* src = data.data() + b * stride();
+            if (peak[b] > .0f) {
+                mixGain(dst, src, frames, applied[b], target);
+            }
+            applied[b] = target;
+            if (reverb) {
+                const float send_target = target * send[b];
+                if (peak[b] > .0f) {
+                    mixGain(send_block.data(), src, frames, send_applied[b], send_target);
+                }
+                send_applied[b] = send_target;
+            }
+        }
+        if (reverb) {
+            reverb->process(send_block.data(), dst, frames, reverb_return);
+        }
+    }
+private:
+    static void mixGain(float* dst, const float* src, size_t frames, float from, float to) {
+        if (from == to) {
+            if (to != .0f) {
+                audioMixKernels().mix_stereo_f32(dst, src, frames, to, to);
+            }
+        } else {
+            audioMixStereoRampF32(dst, src, frames, from, to);
+        }
+    }
+    void updateDucking(int b, size_t frames) {
+        const AudioBusConfig& c = cfg[b];
+        if (!c.duck_sidechain) {
+            duck_gain[b] = 1.0f;
+            return;
+        }
+        float key = .0f;
+        for (int s = 0; s < AUDIO_CATEGORY_COUNT; ++s) {
+            if (s != b && (c.duck_sidechain & (1u << s))) {
+                key = std::max(key, level[s]);
+            }
+        }
+        const float threshold = powf(10.0f, c.duck_threshold_db / 20.0f);
+        const float target = key > threshold ? powf(10.0f, c.duck_db / 20.0f) : 1.0f;
+        const float seconds = target < duck_gain[b] ? c.duck_attack_seconds : c.duck_release_seconds;
+        const float k = expf(-(float)frames / std::max(1.0f, seconds * sample_rate));
+        duck_gain[b] = target + (duck_gain[b] - target) * k;
+    }
+};
+
+#endif
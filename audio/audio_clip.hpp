@@ -1,78 +1,172 @@
 #pragma once
 
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
 #include <memory>
-#include <conio.h>
+#include <string>
+#include <vector>
 #include "../log/log.hpp"
+#include "../filesystem/filesystem.hpp"
 #include "audio_mixer.hpp"
+#include "audio_file_mapping.hpp"
+#include "audio_loudness.hpp"
+#include "audio_pcm_cache.hpp"
+#include "audio_trim.hpp"
 
 class AudioClip {
     std::unique_ptr<AudioBuffer> buf;
+    AudioLoudness loudness;
+    AudioTrim trim;
 public:
     AudioBuffer* getBuffer() { return buf.get(); }
+    size_t byteSize() { return buf ? buf->byteSize() : 0; }
+    // Measured by load(), see AudioLoudness::normalizeGain()
+    const AudioLoudness& getLoudness() const { return loudness; }
+    // Silence load() cut off, in frames of the untrimmed buffer
+    const AudioTrim& getTrim() const { return trim; }
 
+    // Clips keep their native sample rate,
+    // the mixer resamples them per voice at playback
     virtual bool deserialize(const unsigned char* data, size_t sz) {
-        constexpr int targetSampleRate = 48000;
-
         int channels = 2;
-        int sampleRate = targetSampleRate;
+        int sampleRate = 0;
         short* decoded;
         int len;
         len = stb_vorbis_decode_memory(data, sz, &channels, &sampleRate, &decoded);
+        if (len < 0) {
+            return false;
+        }
 
-        buf.reset(new AudioBuffer(
-            decoded, len * sizeof(short) * channels, sampleRate, channels
-        ));
-        // TODO: ?
-        /*
-        if (sampleRate > targetSampleRate) {
-            LOG_WARN("Audio clip downsampling on load from " << sampleRate << " to " << targetSampleRate);
-            //assert(channels == 1);
-            // TODO: Fix for stereo
-            float resampleRate = float(targetSampleRate) / (float)sampleRate;
-            std::vector<short> resampled;
-            int resampled_len = (len * resampleRate + 1) * channels;
-            resampled.resize(resampled_len);
-            for (int i = 0; i < resampled_len; ++i) {
-                float jf = i / resampleRate;
-                int j0 = floor(jf);
-                int j1 = ceil(jf);
-                float diff = jf - (float)j0;
-                int sample = gfxm::lerp(decoded[j0], +decoded[j1], diff);
-                resampled[i] = (short)sample;
-            }
-
-            buf.reset(new AudioBuffer(
-                resampled.data(), resampled_len * sizeof(short), targetSampleRate, channels
-            ));
-        } else if(sampleRate < targetSampleRate) {
-            LOG_WARN("Audio clip upsampling on load from " << sampleRate << " to " << targetSampleRate);
-            //assert(channels == 1);
-            // TODO: Fix for stereo
-            float resampleRate = float(targetSampleRate) / float(sampleRate);
-            std::vector<short> resampled;
-            int resampled_len = (len * resampleRate) * (float)channels;
-            resampled.resize(resampled_len);
-
-            for (int i = 0; i < resampled_len; ++i) {                
-                float jf = i / resampleRate;
-                int j0 = floor(jf);
-                int j1 = ceil(jf);
-                float diff = jf - (float)j0;
+        // The decoder's allocation becomes the buffer, no copy
+        buf.reset(AudioBuffer::adopt(decoded, (size_t)len * channels, sampleRate, channels, free));
+        return true;
+    }
 
-                int sample = gfxm::lerp(decoded[j0], decoded[j1], diff);// gfxm::smoothstep(decoded[j0], decoded[j1], diff);
-                resampled[i] = (short)sample;
+    // .wav (16 bit PCM) files are mapped and played in place.
+    // Anything else is vorbis, served from the pcm cache when it has
+    // a fresh entry, otherwise decoded and added to it.
+    // Loudness is measured on decode and kept in the cache entry.
+    // Leading and trailing silence is trimmed off (audioClipTrimConfig()),
+    // the buffer is then a view of the middle, nothing is copied
+    bool load(const std::string& path) {
+        if (!loadFull(path)) {
+            return false;
+        }
+        trim = audioFindTrim(buf.get(), audioClipTrimConfig());
+        buf = audioTrimBuffer(std::move(buf), trim);
+        return true;
+    }
+    // The file as it is: nothing trimmed, no loudness measured, the
+    // pcm cache neither read nor written. For reverb impulse responses,
+    // where the silence before and the quiet tail are part of the room
+    bool loadRaw(const std::string& path) {
+        return isWavPath(path) ? mapWav(path) : decodeFile(path);
+    }
+private:
+    bool loadFull(const std::string& path) {
+        if (isWavPath(path)) {
+            if (!mapWav(path)) {
+                return false;
             }
-
-            buf.reset(new AudioBuffer(
-                resampled.data(), resampled_len * sizeof(short), targetSampleRate, channels
-            ));
-        } else {
-            buf.reset(new AudioBuffer(
-                decoded, len * sizeof(short) * channels, sampleRate, channels
-            ));
-        }*/
-
-        free(decoded);
+            loudness = audioMeasureLoudness(buf.get());
+            return true;
+        }
+        AudioPcmCache& cache = audioPcmCache();
+        buf = cache.load(path, &loudness);
+        if (buf && loudness.valid) {
+            return true;
+        }
+        // Entries from before loudness was measured are redone
+        if (!decodeFile(path)) {
+            return false;
+        }
+        loudness = audioMeasureLoudness(buf.get());
+        if (cache.store(path, buf.get(), loudness)) {
+            // Swap the heap copy for the mapped one
+            std::unique_ptr<AudioBuffer> mapped = cache.load(path);
+            if (mapped) {
+                buf = std::move(mapped);
+            }
+        }
         return true;
     }
-};
\ No newline at end of file
+    bool decodeFile(const std::string& path) {
+        std::vector<uint8_t> bytes;
+        if (!fsSlurpFile(path, bytes)) {
+            LOG_WARN("Failed to open sound clip '" << path << "'");
+            return false;
+        }
+        if (!deserialize(bytes.data(), bytes.size())) {
+            LOG_WARN("Failed to decode sound clip '" << path << "'");
+            return false;
+        }
+        return true;
+    }
+    static bool isWavPath(const std::string& path) {
+        if (path.size() < 4) {
+            return false;
+        }
+        std::string ext = path.substr(path.size() - 4);
+        for (auto& c : ext) {
+            c = (char)tolower(c);
+        }
+        return ext == ".wav";
+    }
+    static uint32_t readU32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+    static uint16_t readU16(const uint8_t* p) {
+        return (uint16_t)(p[0] | (p[1] << 8));
+    }
+    bool mapWav(const std::string& path) {
+        std::shared_ptr<AudioFileMapping> map(new AudioFileMapping);
+        if (!map->open(path.c_str())) {
+            LOG_WARN("Failed to open sound clip '" << path << "'");
+            return false;
+        }
+        const uint8_t* p = map->data();
+        const size_t sz = map->size();
+        if (sz < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+            LOG_WARN("'" << path << "' is not a RIFF WAVE file");
+            return false;
+        }
+        int channels = 0;
+        int sample_rate = 0;
+        int bits = 0;
+        size_t at = 12;
+        while (at + 8 <= sz) {
+            const uint8_t* chunk = p + at;
+            size_t chunk_sz = readU32(chunk + 4);
+            size_t body = at + 8;
+            if (memcmp(chunk, "fmt ", 4) == 0 && chunk_sz >= 16 && body + 16 <= sz) {
+                uint16_t format = readU16(p + body);
+                channels = readU16(p + body + 2);
+                sample_rate = (int)readU32(p + body + 4);
+                bits = readU16(p + body + 14);
+                // 1 - PCM, 0xFFFE - WAVE_FORMAT_EXTENSIBLE
+                if (format != 1 && format != 0xFFFE) {
+                    bits = 0;
+                }
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                if (bits != 16 || (channels != 1 && channels != 2)) {
+                    LOG_WARN("'" << path << "' is not 16 bit mono or stereo PCM");
+                    return false;
+                }
+                size_t data_sz = std::min(chunk_sz, sz - body);
+                buf.reset(AudioBuffer::view(
+                    (const short*)(p + body), data_sz / sizeof(short), sample_rate, channels, map
+                ));
+                return true;
+            }
+            at = body + chunk_sz + (chunk_sz & 1);
+        }
+        LOG_WARN("'" << path << "' has no data chunk");
+        return false;
+    }
+};
+
+// Buffer that keeps its clip alive, for AudioMixer::playOnce()
+inline std::shared_ptr<AudioBuffer> audioClipBuffer(const std::shared_ptr<AudioClip>& clip) {
+    return std::shared_ptr<AudioBuffer>(clip, clip->getBuffer());
+}
\ No newline at end of file
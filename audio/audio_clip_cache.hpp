@@ -0,0 +1,253 @@
+#ifndef AUDIO_CLIP_CACHE_HPP
+#define AUDIO_CLIP_CACHE_HPP
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "audio_clip.hpp"
+
+struct AudioClipCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t   bytes = 0;
+    size_t   budget = 0;
+    size_t   count = 0;
+};
+
+// Decoded clips by name, kept under a byte budget.
+// Least recently used clips go first, but a clip that is still
+// referenced outside of the cache (playing, see AudioMixer::playOnce()
+// with a shared buffer) is never evicted; the cache can run over
+// budget until those are done.
+//
+// Open addressing table over a flat entry array, lookups take
+// a std::string_view so no std::string is built per query
+class AudioClipCache {
+public:
+    AudioClipCache(size_t budget_bytes = 256 * 1024 * 1024)
+    : budget(budget_bytes) {}
+
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(sync);
+        budget = bytes;
+        evict();
+    }
+
+    std::shared_ptr<AudioClip> find(std::string_view name) {
+        std::lock_guard<std::mutex> lock(sync);
+        int32_t e = lookup(name, hashName(name));
+        if (e < 0) {
+            ++misses;
+            return std::shared_ptr<AudioClip>();
+        }
+        ++hits;
+        touch(e);
+        return entries[e].clip;
+    }
+
+    // Replaces a clip with the same name
+    void insert(std::string_view name, const std::shared_ptr<AudioClip>& clip) {
+        std::lock_guard<std::mutex> lock(sync);
+        uint32_t hash = hashName(name);
+        int32_t e = lookup(name, hash);
+        if (e < 0) {
+            e = allocEntry();
+            Entry& en = entries[e];
+            en.name = name;
+            en.hash = hash;
+            insertIndex(e);
+            linkFront(e);
+        } else {
+            bytes -= entries[e].bytes;
+            touch(e);
+        }
+        entries[e].clip = clip;
+        entries[e].bytes = clip->byteSize();
+        bytes += entries[e].bytes;
+        evict();
+    }
+
+    // Clips that were playing during the last insert() may be
+    // evictable now
+    void trim() {
+        std::lock_guard<std::mutex> lock(sync);
+        evict();
+    }
+
+    AudioClipCacheStats getStats() {
+        std::lock_guard<std::mutex> lock(sync);
+        AudioClipCacheStats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.evictions = evictions;
+        s.bytes = bytes;
+        s.budget = budget;
+        s.count = count;
+        return s;
+    }
+private:
+    struct Entry {
+        std::string name;
+        std::shared_ptr<AudioClip> clip;
+        size_t   bytes = 0;
+        uint32_t hash = 0;
+        int32_t  prev = -1; // LRU list, front is most recent
+        int32_t  next = -1;
+    };
+
+    std::mutex sync;
+    std::vector<Entry>   entries;
+    std::vector<int32_t> free_entries;
+    std::vector<int32_t> index;     // entry ids, -1 is empty, size is a power of two
+    int32_t lru_front = -1;
+    int32_t lru_back = -1;
+    size_t  count = 0;
+    size_t  bytes = 0;
+    size_t  budget;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    // FNV-1a
+    static uint32_t hashName(std::string_view name) {
+        uint32_t h = 2166136261u;
+        for (char c : name) {
+            h ^= (uint8_t)c;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    int32_t lookup(std::string_view name, uint32_t hash) const {
+        if (index.empty()) {
+            return -1;
+        }
+        size_t mask = index.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            int32_t e = index[i];
+            if (e < 0) {
+                return -1;
+            }
+            const Entry& en = entries[e];
+            if (en.hash == hash && en.name == name) {
+                return e;
+            }
+        }
+    }
+    void insertIndex(int32_t e) {
+        // Keep the load factor under 1/2
+        if ((count + 1) * 2 > index.size()) {
+            std::vector<int32_t> old;
+            old.swap(index);
+            index.assign(old.empty() ? 64 : old.size() * 2, -1);
+            for (int32_t o : old) {
+                if (o >= 0) {
+                    placeIndex(o);
+                }
+            }
+        }
+        placeIndex(e);
+        ++count;
+    }
+    void placeIndex(int32_t e) {
+        size_t mask = index.size() - 1;
+        size_t i = entries[e].hash & mask;
+        while (index[i] >= 0) {
+            i = (i + 1) & mask;
+        }
+        index[i] = e;
+    }
+    // Backward shift deletion, no tombstones
+    void eraseIndex(int32_t e) {
+        size_t mask = index.size() - 1;
+        size_t i = entries[e].hash & mask;
+        while (index[i] != e) {
+            i = (i + 1) & mask;
+        }
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (index[j] < 0) {
+                break;
+            }
+            size_t home = entries[index[j]].hash & mask;
+            // Move j into the hole at i unless its home lies in (i, j]
+            bool in_range = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+            if (!in_range) {
+                index[i] = index[j];
+                i = j;
+            }
+        }
+        index[i] = -1;
+        --count;
+    }
+
+    int32_t allocEntry() {
+        if (!free_entries.empty()) {
+            int32_t e = free_entries.back();
+            free_entries.pop_back();
+            return e;
+        }
+        entries.push_back(Entry());
+        return (int32_t)entries.size() - 1;
+    }
+
+    void linkFront(int32_t e) {
+        Entry& en = entries[e];
+        en.prev = -1;
+        en.next = lru_front;
+        if (lru_front >= 0) {
+            entries[lru_front].prev = e;
+        }
+        lru_front = e;
+        if (lru_back < 0) {
+            lru_back = e;
+        }
+    }
+    void unlink(int32_t e) {
+        Entry& en = entries[e];
+        if (en.prev >= 0) {
+            entries[en.prev].next = en.next;
+        } else {
+            lru_front = en.next;
+        }
+        if (en.next >= 0) {
+            entries[en.next].prev = en.prev;
+        } else {
+            lru_back = en.prev;
+        }
+        en.prev = -1;
+        en.next = -1;
+    }
+    void touch(int32_t e) {
+        if (lru_front == e) {
+            return;
+        }
+        unlink(e);
+        linkFront(e);
+    }
+
+    void evict() {
+        int32_t e = lru_back;
+        while (bytes > budget && e >= 0) {
+            int32_t prev = entries[e].prev;
+            // The cache's own reference is the only one when nothing plays it
+            if (entries[e].clip.use_count() == 1) {
+                bytes -= entries[e].bytes;
+                eraseIndex(e);
+                unlink(e);
+                entries[e] = Entry();
+                free_entries.push_back(e);
+                ++evictions;
+            }
+            e = prev;
+        }
+    }
+};
+
+#endif
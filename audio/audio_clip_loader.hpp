@@ -0,0 +1,150 @@
+#ifndef AUDIO_CLIP_LOADER_HPP
+#define AUDIO_CLIP_LOADER_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../log/log.hpp"
+#include "audio_clip.hpp"
+
+// Reads and decodes clips on a small worker pool so the caller
+// (the IRC thread) never waits on disk or the vorbis decoder.
+// Requests for a clip that is already being loaded don't start
+// another decode, their callbacks are queued on the pending one
+class AudioClipLoader {
+public:
+    // Called on a worker thread, clip is null if loading failed
+    typedef std::function<void(const std::shared_ptr<AudioClip>&)> callback_t;
+
+    ~AudioClipLoader() {
+        cleanup();
+    }
+
+    // 0 picks a worker count from the core count
+    void init(int n_workers = 0) {
+        std::unique_lock<std::mutex> lock(sync);
+        if (working) {
+            return;
+        }
+        if (n_workers <= 0) {
+            n_workers = std::max(1, std::min(4, (int)std::thread::hardware_concurrency() / 2));
+        }
+        working = true;
+        for (int i = 0; i < n_workers; ++i) {
+            workers.push_back(std::thread([this]() { run(); }));
+        }
+    }
+    // Pending requests are dropped without calling back
+    void cleanup() {
+        {
+            std::unique_lock<std::mutex> lock(sync);
+            if (!working) {
+                return;
+            }
+            working = false;
+            queue.clear();
+            cv.notify_all();
+        }
+        for (auto& t : workers) {
+            t.join();
+        }
+        workers.clear();
+        in_flight.clear();
+    }
+
+    // name identifies the clip for deduplication
+    void load(const std::string& name, const std::string& path, const callback_t& cb) {
+        std::unique_lock<std::mutex> lock(sync);
+        if (!working) {
+            lock.unlock();
+            init();
+            lock.lock();
+        }
+        auto it = in_flight.find(name);
+        if (it != in_flight.end()) {
+            it->second.callbacks.push_back(cb);
+            return;
+        }
+        Request& rq = in_flight[name];
+        rq.path = path;
+        rq.callbacks.push_back(cb);
+        queue.push_back(name);
+        cv.notify_one();
+    }
+
+    size_t pendingCount() {
+        std::unique_lock<std::mutex> lock(sync);
+        return in_flight.size();
+    }
+private:
+    struct Request {
+        std::string path;
+        std::vector<callback_t> callbacks;
+    };
+
+    std::mutex sync;
+    std::condition_variable cv;
+    std::unordered_map<std::string, Request> in_flight;
+    std::deque<std::string> queue;
+    std::vector<std::thread> workers;
+    bool working = false;
+
+    void run() {
+        std::vector<callback_t> callbacks;
+        while (true) {
+            std::string name;
+            std::string path;
+            {
+                std::unique_lock<std::mutex> lock(sync);
+                cv.wait(lock, [this]() { return !working || !queue.empty(); });
+                if (!working) {
+                    break;
+                }
+                name = queue.front();
+                queue.pop_front();
+                path = in_flight[name].path;
+            }
+
+            std::shared_ptr<AudioClip> clip(new AudioClip);
+            if (!clip->load(path)) {
+                clip.reset();
+            }
+
+            // Requests that come in while callbacks run still
+            // join this load instead of decoding again
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(sync);
+                    auto it = in_flight.find(name);
+                    if (it == in_flight.end()) {
+                        break;
+                    }
+                    callbacks.swap(it->second.callbacks);
+                    if (callbacks.empty()) {
+                        in_flight.erase(it);
+                        break;
+                    }
+                }
+                for (auto& cb : callbacks) {
+                    cb(clip);
+                }
+                callbacks.clear();
+            }
+        }
+    }
+};
+
+inline AudioClipLoader& audioClipLoader() {
+    static AudioClipLoader loader;
+    return loader;
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef AUDIO_COMMAND_QUEUE_HPP
+#define AUDIO_COMMAND_QUEUE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "../math/gfxm.hpp"
+#include "audio_buffer.hpp"
+#include "audio_bus.hpp"
+#include "audio_limiter.hpp"
+#include "audio_mix_pool.hpp"
+#include "audio_resampler.hpp"
+
+// Wait-free single producer/single consumer ring.
+// push() and pop() never block, they fail when full/empty instead
+template<typename T, size_t CAPACITY>
+class AudioRingBuffer {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "AudioRingBuffer capacity must be a power of two");
+    static constexpr size_t MASK = CAPACITY - 1;
+
+    alignas(64) std::atomic<size_t> head{ 0 }; // consumer
+    alignas(64) std::atomic<size_t> tail{ 0 }; // producer
+    alignas(64) T items[CAPACITY];
+public:
+    bool push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == CAPACITY) {
+            return false;
+        }
+        items[t & MASK] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[h & MASK];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    // Approximate when called from a third thread
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return CAPACITY; }
+};
+
+class AudioStream;
+
+enum AUDIO_STEAL_MODE {
+    AUDIO_STEAL_OLDEST,
+    AUDIO_STEAL_QUIETEST
+};
+
+// Upper bound on what the audio thread mixes per block.
+// A voice starting over a cap takes the place of a playing voice of
+// the same or lower priority (lowest priority first, then oldest or
+// quietest), which fades out over fade_seconds. If there's none it
+// doesn't start at all
+struct AudioPolyphonyConfig {
+    int   max_voices = 64;
+    int   category_max[AUDIO_CATEGORY_COUNT] = { 48, 4, 4, 8 };
+    AUDIO_STEAL_MODE steal = AUDIO_STEAL_OLDEST;
+    float fade_seconds = .005f;
+    // Voices still fading out, beyond this stolen voices are cut instead
+    int   max_fading = 16;
+};
+
+// Merging of one-shots that play the same buffer at nearly the same
+// time (a chat spamming one sound). Within window_seconds of a voice
+// starting, another play of its buffer becomes part of it instead:
+// the gains add up by power, capped at max_gain. Up to max_voices
+// voices per buffer may still start in a window if they're at least
+// min_offset_seconds apart, so a burst stays audible as several hits.
+// Looping, 3d and stream voices are never merged
+struct AudioCoalesceConfig {
+    bool  enabled = false;
+    float window_seconds = .3f;
+    int   max_voices = 1;
+    float min_offset_seconds = .05f;
+    float max_gain = 2.0f;
+};
+
+// 3d voices. Past their attenuation radius they lose highs as well as
+// level: a one-pole low-pass closes in with distance, air_absorption
+// is how fast (0 turns it off). The default is down to about 8 kHz
+// three radii out and 2.6 kHz at eleven
+struct AudioSpatialConfig {
+    float air_absorption = .25f;
+};
+
+// Everything the audio thread needs to know about a voice
+// that is set from the outside
+struct AudioVoiceParams {
+    AudioBuffer*   buf = 0;
+    AudioStream*   stream = 0;     // plays instead of buf if set
+    AudioResampler resampler;
+    float          volume = 1.0f;
+    float          panning = .0f;
+    float          attenuation_radius = 10.0f;
+    gfxm::vec3     pos;
+    bool           looping = false;
+    bool           is3d = false;
+    uint8_t        category = AUDIO_CATEGORY_SFX;
+    int8_t         priority = 0;   // higher wins
+    uint64_t       start_frame = 0; // mixer frame clock to start at, anything past is right away
+};
+
+enum AUDIO_CMD {
+    AUDIO_CMD_INIT,         // voice slot (re)assigned, resets the cursor
+    AUDIO_CMD_PLAY,
+    AUDIO_CMD_STOP,
+    AUDIO_CMD_UPDATE,       // new params for a playing or paused voice
+    AUDIO_CMD_RESET_CURSOR,
+    AUDIO_CMD_LISTENER,
+    AUDIO_CMD_POLYPHONY,
+    AUDIO_CMD_COALESCE,
+    AUDIO_CMD_LIMITER,
+    AUDIO_CMD_MIX_POOL,     // mix_pool.pool replaces the current one, 0 for none
+    AUDIO_CMD_BUS,          // bus.config for bus.category
+    AUDIO_CMD_REVERB,       // reverb.convolver replaces the current one, 0 for none
+    AUDIO_CMD_SPATIAL
+};
+
+// type picks the member of the union that's set. Configs go by
+// pointer to a copy the control side keeps in its graveyard until the
+// command is applied, so no entry is bigger than a voice's params
+struct AudioCommand {
+    AUDIO_CMD        type;
+    uint32_t         voice;
+    uint32_t         generation;
+    union {
+        AudioVoiceParams            params;     // PLAY, UPDATE
+        gfxm::mat4                  listener;
+        const AudioPolyphonyConfig* polyphony;
+        const AudioCoalesceConfig*  coalesce;
+        const AudioLimiterConfig*   limiter;
+        AudioSpatialConfig          spatial;
+        struct {
+            const AudioBusConfig* config;
+            int                   category;
+        } bus;
+        struct {
+            AudioMixPool* pool;
+            int           min_voices;
+        } mix_pool;
+        struct {
+            AudioConvolver* convolver;
+            float           return_gain;
+        } reverb;
+    };
+
+    AudioCommand() : type(AUDIO_CMD_INIT), voice(0), generation(0), params() {}
+};
+
+enum AUDIO_EVT {
+    AUDIO_EVT_VOICE_FINISHED
+};
+
+struct AudioEvent {
+    AUDIO_EVT type;
+    uint32_t  voice;
+    uint32_t  generation;
+};
+
+// Recorded by the audio thread for every block it renders
+struct AudioBlockStats {
+    uint32_t process_ns;    // commands + mix + limiter
+    uint32_t frames;
+    uint16_t voices;
+    uint16_t command_depth; // commands waiting when the block started
+    float    peak;          // mix peak before the limiter
+};
+
+#endif
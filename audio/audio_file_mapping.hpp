@@ -0,0 +1,111 @@
+#ifndef AUDIO_FILE_MAPPING_HPP
+#define AUDIO_FILE_MAPPING_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../log/log.hpp"
+
+// Read-only mapping of a whole file. Pages come from the OS file
+// cache, so several processes mapping the same file share them
+class AudioFileMapping {
+    const uint8_t* ptr = 0;
+    size_t sz = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = 0;
+#endif
+public:
+    AudioFileMapping() {}
+    AudioFileMapping(const AudioFileMapping&) = delete;
+    AudioFileMapping& operator=(const AudioFileMapping&) = delete;
+    ~AudioFileMapping() {
+        close();
+    }
+
+    bool open(const char* path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        if (!mapping) {
+            LOG_WARN("CreateFileMapping failed for '" << path << "': " << GetLastError());
+            close();
+            return false;
+        }
+        ptr = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!ptr) {
+            LOG_WARN("MapViewOfFile failed for '" << path << "': " << GetLastError());
+            close();
+            return false;
+        }
+        sz = (size_t)file_size.QuadPart;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping stays valid without the descriptor
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            LOG_WARN("mmap failed for '" << path << "'");
+            return false;
+        }
+        ptr = (const uint8_t*)p;
+        sz = (size_t)st.st_size;
+#endif
+        return true;
+    }
+    void close() {
+#ifdef _WIN32
+        if (ptr) {
+            UnmapViewOfFile(ptr);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = 0;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (ptr) {
+            munmap((void*)ptr, sz);
+        }
+#endif
+        ptr = 0;
+        sz = 0;
+    }
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return sz; }
+};
+
+#endif
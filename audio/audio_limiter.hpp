@@ -0,0 +1,163 @@
+#ifndef AUDIO_LIMITER_HPP
+#define AUDIO_LIMITER_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+
+#include "audio_simd.hpp"
+
+struct AudioLimiterConfig {
+    bool  enabled = true;
+    float ceiling_db = -1.0f;       // output never goes over this
+    float knee_db = 6.0f;           // gain reduction starts knee_db / 2 below the ceiling
+    float release_seconds = .08f;
+};
+
+// Look-ahead peak limiter for the interleaved stereo master bus.
+// Works on fixed chunks of CHUNK frames: each chunk's peak sets a
+// target gain (soft knee curve), and the gain ramps linearly so it has
+// reached every target by the time that chunk is output, LOOKAHEAD
+// frames later. Cost per frame is the same whatever the signal does;
+// a final clamp to the ceiling catches what the ramps can't
+class AudioLimiter {
+public:
+    static constexpr int CHUNK = 16;
+    static constexpr int LOOKAHEAD_CHUNKS = 4;
+    static constexpr int LOOKAHEAD = CHUNK * LOOKAHEAD_CHUNKS;
+    static constexpr int SLOTS = LOOKAHEAD_CHUNKS + 1;
+
+    void init(int sampleRate, const AudioLimiterConfig& cfg = AudioLimiterConfig()) {
+        sample_rate = sampleRate;
+        memset(delay, 0, sizeof(delay));
+        for (int i = 0; i < SLOTS; ++i) {
+            targets[i] = 1.0f;
+        }
+        in_slot = 0;
+        fill = 0;
+        gain = 1.0f;
+        gain_step = .0f;
+        setConfig(cfg);
+    }
+    void setConfig(const AudioLimiterConfig& cfg) {
+        this->cfg = cfg;
+        ceiling = powf(10.0f, cfg.ceiling_db / 20.0f);
+        float release_frames = std::max(1.0f, cfg.release_seconds * sample_rate);
+        release = 1.0f - expf(-(float)CHUNK / release_frames);
+    }
+    const AudioLimiterConfig& getConfig() const { return cfg; }
+    // Output lags input by this much
+    int latency() const { return LOOKAHEAD; }
+
+    // In place, any frame count
+    void process(float* io, size_t frames) {
+        while (frames) {
+            size_t n = std::min(frames, (size_t)(CHUNK - fill));
+            float* in = delay[in_slot] + fill * 2;
+            float* out = delay[(in_slot + 1) % SLOTS] + fill * 2;
+            float tmp[CHUNK * 2];
+            memcpy(tmp, io, n * 2 * sizeof(float));
+            applyGain(io, out, n);
+            memcpy(in, tmp, n * 2 * sizeof(float));
+            io += n * 2;
+            frames -= n;
+            fill += (int)n;
+            if (fill == CHUNK) {
+                targets[in_slot] = targetGain(peak(delay[in_slot]));
+                in_slot = (in_slot + 1) % SLOTS;
+                fill = 0;
+                plan();
+            }
+        }
+    }
+private:
+    AudioLimiterConfig cfg;
+    int   sample_rate = 48000;
+    float ceiling = 1.0f;
+    float release = 1.0f;
+    alignas(16) float delay[SLOTS][CHUNK * 2];
+    float targets[SLOTS];
+    int   in_slot = 0;
+    int   fill = 0;
+    float gain = 1.0f;      // at the start of the chunk being output
+    float gain_step = .0f;  // per frame
+
+    // Soft knee on the chunk peak, in dB: flat below the knee,
+    // quadratic through it, capped at the ceiling above it
+    float targetGain(float p) const {
+        if (p <= 1e-9f) {
+            return 1.0f;
+        }
+        const float x = 20.0f * log10f(p);
+        const float t = cfg.ceiling_db;
+        const float w = cfg.knee_db;
+        float y = x;
+        if (x >= t + w * .5f) {
+            y = t;
+        } else if (w > .0f && x > t - w * .5f) {
+            float d = x - t + w * .5f;
+            y = x - d * d / (2.0f * w);
+        }
+        return y >= x ? 1.0f : powf(10.0f, (y - x) / 20.0f);
+    }
+
+    // Gain ramp for the next chunk out. Chunk o chunks after it
+    // needs the ramp down to its target by the time it starts
+    void plan() {
+        gain += gain_step * CHUNK;
+        const int out_slot = (in_slot + 1) % SLOTS;
+        float end = gain + (1.0f - gain) * release;
+        end = std::min(end, targets[out_slot]);
+        for (int o = 1; o < LOOKAHEAD_CHUNKS; ++o) {
+            float t = targets[(out_slot + o) % SLOTS];
+            end = std::min(end, gain + (t - gain) / o);
+        }
+        gain_step = (end - gain) / CHUNK;
+    }
+
+    float peak(const float* chunk) const {
+#ifdef AUDIO_SIMD_X86
+        const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+        __m128 m = _mm_setzero_ps();
+        for (int i = 0; i < CHUNK * 2; i += 4) {
+            m = _mm_max_ps(m, _mm_and_ps(_mm_load_ps(chunk + i), abs_mask));
+        }
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(m);
+#else
+        float m = .0f;
+        for (int i = 0; i < CHUNK * 2; ++i) {
+            m = std::max(m, fabsf(chunk[i]));
+        }
+        return m;
+#endif
+    }
+
+    // dst = src * ramp, clamped to the ceiling. n frames from
+    // position fill of the chunk being output
+    void applyGain(float* dst, const float* src, size_t n) const {
+        float g = gain + gain_step * fill;
+        size_t i = 0;
+#ifdef AUDIO_SIMD_X86
+        const __m128 hi = _mm_set1_ps(ceiling);
+        const __m128 lo = _mm_set1_ps(-ceiling);
+        __m128 gv = _mm_setr_ps(g, g, g + gain_step, g + gain_step);
+        const __m128 step = _mm_set1_ps(gain_step * 2.0f);
+        for (; i + 2 <= n; i += 2) {
+            __m128 s = _mm_mul_ps(_mm_loadu_ps(src + i * 2), gv);
+            _mm_storeu_ps(dst + i * 2, _mm_max_ps(lo, _mm_min_ps(hi, s)));
+            gv = _mm_add_ps(gv, step);
+        }
+        g += gain_step * i;
+#endif
+        for (; i < n; ++i) {
+            dst[i * 2]     = std::max(-ceiling, std::min(ceiling, src[i * 2] * g));
+            dst[i * 2 + 1] = std::max(-ceiling, std::min(ceiling, src[i * 2 + 1] * g));
+            g += gain_step;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef AUDIO_LOUDNESS_HPP
+#define AUDIO_LOUDNESS_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+#include "audio_buffer.hpp"
+#include "audio_resampler.hpp"
+
+#define AUDIO_LOUDNESS_TARGET_LUFS -16.0f
+#define AUDIO_LOUDNESS_MAX_TRUE_PEAK_DB -1.0f
+
+// Measured once per clip when it's decoded
+struct AudioLoudness {
+    bool  valid = false;
+    float integrated_lufs = -70.0f;
+    float true_peak_db = -70.0f;    // dBTP, relative to full scale
+
+    // Gain that brings the clip to target_lufs without pushing its
+    // true peak over max_true_peak_db. 1 when unmeasured or silent
+    float normalizeGain(
+        float target_lufs = AUDIO_LOUDNESS_TARGET_LUFS,
+        float max_true_peak_db = AUDIO_LOUDNESS_MAX_TRUE_PEAK_DB
+    ) const {
+        if (!valid || integrated_lufs <= -70.0f) {
+            return 1.0f;
+        }
+        float db = std::min(target_lufs - integrated_lufs, max_true_peak_db - true_peak_db);
+        return powf(10.0f, db / 20.0f);
+    }
+};
+
+// Two stage K-weighting filter from ITU-R BS.1770, coefficients
+// derived for any sample rate
+struct AudioKWeighting {
+    double b[2][3];
+    double a[2][3];
+    double z[2][2] = { { .0, .0 }, { .0, .0 } };
+
+    explicit AudioKWeighting(int sampleRate) {
+        const double pi = 3.14159265358979323846;
+        // High shelf
+        double f0 = 1681.974450955533;
+        double G = 3.999843853973347;
+        double Q = .7071752369554196;
+        double K = tan(pi * f0 / sampleRate);
+        double Vh = pow(10.0, G / 20.0);
+        double Vb = pow(Vh, .4996667741545416);
+        double a0 = 1.0 + K / Q + K * K;
+        b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+        b[0][1] = 2.0 * (K * K - Vh) / a0;
+        b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+        a[0][0] = 1.0;
+        a[0][1] = 2.0 * (K * K - 1.0) / a0;
+        a[0][2] = (1.0 - K / Q + K * K) / a0;
+        // High pass
+        f0 = 38.13547087602444;
+        Q = .5003270373238773;
+        K = tan(pi * f0 / sampleRate);
+        a0 = 1.0 + K / Q + K * K;
+        b[1][0] = 1.0;
+        b[1][1] = -2.0;
+        b[1][2] = 1.0;
+        a[1][0] = 1.0;
+        a[1][1] = 2.0 * (K * K - 1.0) / a0;
+        a[1][2] = (1.0 - K / Q + K * K) / a0;
+    }
+    // Transposed direct form II
+    double process(double x) {
+        for (int s = 0; s < 2; ++s) {
+            double y = b[s][0] * x + z[s][0];
+            z[s][0] = b[s][1] * x - a[s][1] * y + z[s][1];
+            z[s][1] = b[s][2] * x - a[s][2] * y;
+            x = y;
+        }
+        return x;
+    }
+};
+
+// Integrated loudness (BS.1770 / EBU R128 gating: 400 ms blocks with
+// 75% overlap, -70 LUFS absolute and -10 LU relative gates) and true
+// peak (4x oversampled through the resampler's sinc table).
+// Clips shorter than one block are measured as a single block
+template<typename T>
+AudioLoudness audioMeasureLoudness(const T* samples, size_t frames, int channels, int sampleRate, float scale) {
+    AudioLoudness r;
+    if (!frames || sampleRate <= 0 || channels < 1) {
+        return r;
+    }
+
+    // Mean square per 100 ms step, summed over channels
+    const size_t step = std::max<size_t>(1, (size_t)sampleRate / 10);
+    std::vector<double> steps((frames + step - 1) / step, .0);
+    for (int c = 0; c < channels; ++c) {
+        AudioKWeighting k(sampleRate);
+        for (size_t i = 0; i < frames; ++i) {
+            double y = k.process(samples[i * channels + c] * (double)scale);
+            steps[i / step] += y * y;
+        }
+    }
+
+    std::vector<double> blocks;
+    if (steps.size() < 4) {
+        double sum = .0;
+        for (double s : steps) {
+            sum += s;
+        }
+        blocks.push_back(sum / frames);
+    } else {
+        for (size_t i = 0; i + 4 <= steps.size(); ++i) {
+            size_t n = std::min(frames, (i + 4) * step) - i * step;
+            blocks.push_back((steps[i] + steps[i + 1] + steps[i + 2] + steps[i + 3]) / n);
+        }
+    }
+
+    auto lufs = [](double ms) { return -.691 + 10.0 * log10(std::max(ms, 1e-20)); };
+    double sum = .0;
+    size_t n = 0;
+    for (double b : blocks) {
+        if (lufs(b) > -70.0) {
+            sum += b;
+            ++n;
+        }
+    }
+    if (n) {
+        double relative_gate = lufs(sum / n) - 10.0;
+        sum = .0;
+        n = 0;
+        for (double b : blocks) {
+            if (lufs(b) > -70.0 && lufs(b) > relative_gate) {
+                sum += b;
+                ++n;
+            }
+        }
+    }
+    r.integrated_lufs = n ? (float)lufs(sum / n) : -70.0f;
+
+    // Sample peak plus the peaks between samples
+    const AudioSincTable* table = audioGetSincTable(sampleRate, sampleRate);
+    const int half = AudioSincTable::TAPS / 2 - 1;
+    const int phase_step = AudioSincTable::PHASES / 4;
+    float peak = .0f;
+    for (int c = 0; c < channels; ++c) {
+        for (size_t i = 0; i < frames; ++i) {
+            peak = std::max(peak, fabsf(samples[i * channels + c] * scale));
+            for (int p = phase_step; p < AudioSincTable::PHASES; p += phase_step) {
+                const float* coefs = table->coefs[p];
+                float acc = .0f;
+                for (int k = 0; k < AudioSincTable::TAPS; ++k) {
+                    ptrdiff_t j = (ptrdiff_t)i + k - half;
+                    if (j >= 0 && j < (ptrdiff_t)frames) {
+                        acc += coefs[k] * samples[j * channels + c];
+                    }
+                }
+                peak = std::max(peak, fabsf(acc * scale));
+            }
+        }
+    }
+    r.true_peak_db = peak > .0f ? std::max(-70.0f, 20.0f * log10f(peak)) : -70.0f;
+    r.valid = true;
+    return r;
+}
+
+inline AudioLoudness audioMeasureLoudness(AudioBuffer* buf) {
+    const size_t frames = buf->sampleCount() / buf->channelCount();
+    if (buf->sampleFormat() == AUDIO_SAMPLE_F32) {
+        return audioMeasureLoudness(buf->getPtrF32(), frames, buf->channelCount(), buf->sampleRate(), 1.0f);
+    }
+    return audioMeasureLoudness(buf->getPtr(), frames, buf->channelCount(), buf->sampleRate(), 1.0f / 32768.0f);
+}
+
+#endif
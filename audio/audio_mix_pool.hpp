@@ -0,0 +1,250 @@
+#ifndef AUDIO_MIX_POOL_HPP
+#define AUDIO_MIX_POOL_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <condition_variable>
+#include <mutex>
+#endif
+
+#include "audio_simd.hpp"
+
+// Parallel mix mode. workers 0 mixes everything on the backend thread
+// as before. Below min_voices a block is mixed there too, handing off
+// costs more than it saves
+struct AudioParallelMixConfig {
+    int  workers = 0;       // threads besides the backend thread, at most cores - 1
+    int  min_voices = 96;
+    bool pin = true;        // one core per worker, time critical priority on windows
+};
+
+// Callback for one item of a job. dst is the block the item mixes
+// into and scratch is a block of temp space, both private to the
+// thread running it
+typedef void (*audio_mix_job_fn_t)(void* ctx, size_t item, float* dst, float* scratch);
+
+// Auto-reset event, a set() with nobody waiting wakes the next wait()
+class AudioMixWake {
+#ifdef _WIN32
+    HANDLE event = CreateEventW(0, FALSE, FALSE, 0);
+public:
+    ~AudioMixWake() {
+        CloseHandle(event);
+    }
+    void set() {
+        SetEvent(event);
+    }
+    void wait() {
+        WaitForSingleObject(event, INFINITE);
+    }
+#else
+    std::mutex sync;
+    std::condition_variable cv;
+    bool signaled = false;
+public:
+    void set() {
+        {
+            std::lock_guard<std::mutex> lock(sync);
+            signaled = true;
+        }
+        cv.notify_one();
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(sync);
+        cv.wait(lock, [this]() { return signaled; });
+        signaled = false;
+    }
+#endif
+};
+
+// Helper threads for the mixer. run() splits a job's items between
+// the calling (backend) thread and the workers: every thread claims
+// items off a shared cursor until there are none left, so a worker
+// that wakes up late just finds less to do and never holds up the
+// block. Each worker mixes into its own partial block, the caller
+// sums those into its own once every claimed item is done.
+// Nothing on the way takes a lock or waits on a barrier.
+// Between jobs the workers sleep on an event, run() sets the events
+// of the parked ones and starts on the items without waiting for them
+class AudioMixPool {
+    struct Worker {
+        std::thread thread;
+        std::vector<float> partial;
+        std::vector<float> scratch;
+        uint64_t partial_job = 0;   // job partial was last cleared for
+        std::atomic<bool> parked{ false };
+        AudioMixWake wake;
+    };
+
+    // Job id in the high half, items left in the low half, so a claim
+    // can't land in a job the claiming thread hasn't seen
+    alignas(64) std::atomic<uint64_t> cursor{ 0 };
+    alignas(64) std::atomic<int> in_flight{ 0 };
+    alignas(64) std::atomic<uint64_t> job{ 0 };
+    std::atomic<bool> working{ false };
+
+    // Written by the caller before the job id is published, only read
+    // after claiming an item (which the caller then waits for)
+    audio_mix_job_fn_t job_fn = 0;
+    void* job_ctx = 0;
+    uint32_t job_items = 0;
+    size_t job_samples = 0;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    size_t block_samples = 0;
+public:
+    // block_samples is the size of dst blocks, scratch_samples of scratch
+    AudioMixPool(const AudioParallelMixConfig& cfg, size_t block_samples, size_t scratch_samples)
+    : block_samples(block_samples) {
+        working = true;
+        const int cores = std::max(1, (int)std::thread::hardware_concurrency());
+        // A worker sharing a core with the caller only gets preempted mid item
+        const int n = std::max(0, std::min(cfg.workers, cores - 1));
+        for (int i = 0; i < n; ++i) {
+            workers.push_back(std::unique_ptr<Worker>(new Worker));
+            Worker* w = workers.back().get();
+            w->partial.assign(block_samples, .0f);
+            w->scratch.assign(scratch_samples, .0f);
+            w->thread = std::thread([this, w]() { runWorker(w); });
+            if (cfg.pin) {
+                // From the last core down, the first ones are busier
+                pin(w->thread, (cores - 1 - i % cores));
+            }
+        }
+    }
+    ~AudioMixPool() {
+        working.store(false, std::memory_order_seq_cst);
+        for (auto& w : workers) {
+            w->wake.set();
+            w->thread.join();
+        }
+    }
+
+    int workerCount() const { return (int)workers.size(); }
+
+    // Calls fn for every item in [0, items). Returns when all of them are
+    // mixed into dst, which the caller must have cleared. samples <= block_samples
+    void run(audio_mix_job_fn_t fn, void* ctx, size_t items, float* dst, float* scratch, size_t samples) {
+        const uint64_t id = job.load(std::memory_order_relaxed) + 1;
+        job_fn = fn;
+        job_ctx = ctx;
+        job_items = (uint32_t)items;
+        job_samples = std::min(samples, block_samples);
+        cursor.store((id << 32) | (uint32_t)items, std::memory_order_seq_cst);
+        job.store(id, std::memory_order_seq_cst);
+        for (auto& w : workers) {
+            if (w->parked.exchange(false, std::memory_order_seq_cst)) {
+                w->wake.set();
+            }
+        }
+
+        while (claim(id, dst, scratch)) {}
+        // Anyone still inside claim() either got an item before we ran
+        // out and is mixing it, or is about to find the cursor spent
+        for (int spins = 0; in_flight.load(std::memory_order_seq_cst) != 0; ++spins) {
+            if (spins < 4096) {
+                pause();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        for (auto& w : workers) {
+            if (w->partial_job == id) {
+                audioAccumulate(dst, w->partial.data(), job_samples);
+            }
+        }
+    }
+private:
+    // Mixes one item of job id, false if there was none left
+    bool claim(uint64_t id, float* dst, float* scratch, Worker* w = 0) {
+        in_flight.fetch_add(1, std::memory_order_seq_cst);
+        uint64_t c = cursor.load(std::memory_order_seq_cst);
+        while (true) {
+            if ((c >> 32) != id || (uint32_t)c == 0) {
+                in_flight.fetch_sub(1, std::memory_order_release);
+                return false;
+            }
+            if (cursor.compare_exchange_weak(c, c - 1, std::memory_order_seq_cst)) {
+                break;
+            }
+        }
+        if (w && w->partial_job != id) {
+            memset(w->partial.data(), 0, job_samples * sizeof(float));
+            w->partial_job = id;
+        }
+        job_fn(job_ctx, job_items - (uint32_t)c, dst, scratch);
+        in_flight.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    void runWorker(Worker* w) {
+        uint64_t seen = 0;
+        while (working.load(std::memory_order_seq_cst)) {
+            uint64_t id = job.load(std::memory_order_seq_cst);
+            if (id == seen) {
+                park(w, seen);
+                continue;
+            }
+            seen = id;
+            // A stale id only fails to claim
+            while (claim(id, w->partial.data(), w->scratch.data(), w)) {}
+        }
+    }
+    // Jobs come a block apart, far longer than a worker is busy, so it
+    // sleeps as soon as it runs out. parked goes up before the job id
+    // is read again and run() reads parked after publishing the id:
+    // either the worker sees the new job or run() sees it parked.
+    // A set() that turns out not to be needed only costs one extra
+    // round of the loop
+    void park(Worker* w, uint64_t seen) {
+        w->parked.store(true, std::memory_order_seq_cst);
+        if (job.load(std::memory_order_seq_cst) != seen || !working.load(std::memory_order_seq_cst)) {
+            w->parked.store(false, std::memory_order_relaxed);
+            return;
+        }
+        w->wake.wait();
+    }
+    static void pause() {
+#ifdef AUDIO_SIMD_X86
+        _mm_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    static void pin(std::thread& t, int core) {
+#ifdef _WIN32
+        HANDLE h = (HANDLE)t.native_handle();
+        if (core < 64) {
+            SetThreadAffinityMask(h, (DWORD_PTR)1 << core);
+        }
+        SetThreadPriority(h, THREAD_PRIORITY_TIME_CRITICAL);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+        // No SCHED_FIFO, a worker yielding between blocks would
+        // starve everything else on its core
+#else
+        (void)t;
+        (void)core;
+#endif
+    }
+};
+
+#endif
@@ -1,19 +1,19 @@
 #ifndef AUDIO_MIXER_HPP
 #define AUDIO_MIXER_HPP
 
-#define NOMINMAX
-
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <thread>
 #include <mutex>
-#include <unordered_set>
-#include <unordered_map>
+#include <vector>
 
 #include "../handle/handle.hpp"
 
+#include <math.h>
 #include <stdint.h>
-#include <xaudio2.h>
-#pragma comment(lib, "xaudio2.lib")
+#include <string.h>
 
 #include "../math/gfxm.hpp"
 #include "../log/log.hpp"
@@ -23,565 +23,1214 @@ extern "C" {
 #include "../lib/stb_vorbis.c"
 }
 
-#define AUDIO_BUFFER_SZ 256
+#define AUDIO_MAX_VOICES 512
+#define AUDIO_NO_VOICE 0xFFFFFFFF
 
 #include "audio_buffer.hpp"
+#include "audio_backend.hpp"
+#include "audio_simd.hpp"
+#include "audio_resampler.hpp"
+#include "audio_command_queue.hpp"
+#include "audio_voice_table.hpp"
+#include "audio_stream.hpp"
 
 static const int SHORT_MAX = std::numeric_limits<short>().max();
 
+template<int SRC_CHANNELS, bool DOWNMIX>
+struct AudioMixSpan;
+template<bool DOWNMIX>
+struct AudioMixSpan<1, DOWNMIX> {
+    static audio_mix_fn_t get(const AudioMixKernels& k) { return k.mix_mono; }
+    static audio_mix_f32_fn_t getF32(const AudioMixKernels& k) { return k.mix_mono_f32; }
+};
+template<>
+struct AudioMixSpan<2, false> {
+    static audio_mix_fn_t get(const AudioMixKernels& k) { return k.mix_stereo; }
+    static audio_mix_f32_fn_t getF32(const AudioMixKernels& k) { return k.mix_stereo_f32; }
+};
+template<>
+struct AudioMixSpan<2, true> {
+    static audio_mix_fn_t get(const AudioMixKernels& k) { return k.mix_stereo_downmix; }
+    static audio_mix_f32_fn_t getF32(const AudioMixKernels& k) { return k.mix_stereo_downmix_f32; }
+};
+
+template<int SRC_CHANNELS, bool DOWNMIX>
+inline audio_mix_fn_t audioMixSpanFn(const AudioMixKernels& k, const short*) {
+    return AudioMixSpan<SRC_CHANNELS, DOWNMIX>::get(k);
+}
+template<int SRC_CHANNELS, bool DOWNMIX>
+inline audio_mix_f32_fn_t audioMixSpanFn(const AudioMixKernels& k, const float*) {
+    return AudioMixSpan<SRC_CHANNELS, DOWNMIX>::getF32(k);
+}
+
+#define AUDIO_MIN_RATE .25f
+#define AUDIO_MAX_RATE 4.0f
+
+inline float audioClampRate(float rate) {
+    return rate == rate ? std::max(AUDIO_MIN_RATE, std::min(AUDIO_MAX_RATE, rate)) : 1.0f;
+}
+// Playback rate that shifts pitch by semitones
+inline float audioSemitonesToRate(float semitones) {
+    return powf(2.0f, semitones / 12.0f);
+}
+
+// Bot side view of a voice. Only touched by the threads calling
+// into the mixer, the audio thread works on its own AudioVoiceTable copy
 struct AudioChannel {
-    size_t cursor = 0;
     AudioBuffer* buf = 0;
+    std::shared_ptr<void> buf_owner; // keeps buf alive while the voice may use it
+    std::shared_ptr<AudioStream> stream;
+    AUDIO_RESAMPLE_QUALITY resample_quality = AUDIO_RESAMPLE_SINC;
     float volume = 1.0f;
     float panning = 0.0f;
     float attenuation_radius = 10.0f;
     gfxm::vec3 pos;
     bool looping = false;
+    AUDIO_CATEGORY category = AUDIO_CATEGORY_SFX;
+    int priority = 0;
+    uint64_t start_frame = 0;
+    float rate = 1.0f;              // playback speed, pitch goes with it
+
+    uint32_t voice = AUDIO_NO_VOICE;
+    bool one_shot = false;
+    bool playing = false;
+    bool is3d = false;
 
     void setPosition(const gfxm::vec3& p) {
         pos = p;
     }
 };
 
-struct AudioVoiceData {
-    float* front;
-    float* back;
-
-    float buffer_f[AUDIO_BUFFER_SZ];
-    float buffer[AUDIO_BUFFER_SZ];
-    float buffer_back[AUDIO_BUFFER_SZ];
-
-    float buffer_float[AUDIO_BUFFER_SZ];
-    float buffer_back_float[AUDIO_BUFFER_SZ];
-
-    IXAudio2SourceVoice* pSourceVoice;
-
-    std::unordered_set<Handle<AudioChannel>> emitters;
-    std::unordered_set<Handle<AudioChannel>> emitters3d;
-};
-
-class AudioMixer : public IXAudio2VoiceCallback {
+// Mixing core. Doesn't talk to any device itself, the backend
+// pulls blocks through render() at the device sample rate.
+// Every voice is converted to the device rate on the fly,
+// so clips of any rate mix in the same pass.
+//
+// Threading: the public api may be called from any non-audio thread
+// (serialized by control_sync). It never touches audio thread state,
+// changes are sent as AudioCommands and applied at the start of the
+// next block; finished voices come back as AudioEvents and are
+// released on the control side. The audio thread takes no locks
+class AudioMixer : public AudioRenderCallback {
     int sampleRate;
     int bitPerSample;
     int nChannels;
-
-    // key - sample rate
-    std::unordered_map<int, std::unique_ptr<AudioVoiceData>> voices;
-
-    IXAudio2* pXAudio2;
-    IXAudio2MasteringVoice* pMasteringVoice = 0;
-
-    gfxm::mat4 lis_transform;
-    std::mutex sync;
-    
-    bool createSourceVoice(AudioVoiceData* voice, int sampleRate) {
-        const int blockAlign = (bitPerSample * nChannels) / 8;
-
-        WAVEFORMATEX wfx = {
-            WAVE_FORMAT_IEEE_FLOAT,
-            (WORD)nChannels,
-            (DWORD)sampleRate,
-            (DWORD)(sampleRate * blockAlign),
-            (WORD)blockAlign,
-            (WORD)bitPerSample,
-            0
-        };
-        HRESULT hr;
-        if(FAILED(hr = pXAudio2->CreateSourceVoice(&voice->pSourceVoice, &wfx, 0, 1.0f, this)))
-        {
-            LOG_ERR("Failed to create source voice: " << hr);
-            return false;
+    AUDIO_RESAMPLE_QUALITY resample_quality = AUDIO_RESAMPLE_SINC;
+
+    std::unique_ptr<AudioBackend> backend;
+
+    // Control side
+    std::mutex control_sync;
+    std::vector<uint32_t> free_voices;
+    std::vector<uint32_t> voice_generation;
+    std::vector<Handle<AudioChannel>> voice_owner;
+
+    AudioRingBuffer<AudioCommand, 1024> commands;
+    AudioRingBuffer<AudioEvent, AUDIO_MAX_VOICES> events;
+    // A few seconds of blocks at the usual sizes
+    AudioRingBuffer<AudioBlockStats, 4096> block_stats;
+    std::atomic<uint64_t> block_stats_dropped{ 0 };
+    std::atomic<uint64_t> sample_time{ 0 };
+    uint64_t commands_sent = 0;
+    std::atomic<uint64_t> commands_applied{ 0 };
+    // Objects the audio thread may still be looking at, freed once
+    // it has applied every command sent before they were dropped
+    std::vector<std::pair<uint64_t, std::shared_ptr<void>>> graveyard;
+    AudioPolyphonyConfig polyphony_control;
+    AudioParallelMixConfig parallel_control;
+    AudioBusConfig bus_control[AUDIO_CATEGORY_COUNT];
+    std::shared_ptr<AudioMixPool> mix_pool_control;
+    std::shared_ptr<AudioConvolver> reverb_control;
+
+    // Audio thread side
+    AudioBufferingConfig buffering;
+    std::vector<float> buffer_f;      // one block, device channels
+    std::vector<float> resample_buf;  // one block, up to stereo source frames,
+                                      // then a stereo block 3d voices are filtered from
+
+    AudioVoiceTable voices;
+    AudioPolyphonyConfig polyphony;
+    AudioCoalesceConfig coalesce;
+    AudioSpatialConfig spatial;
+    AudioBusMix buses;
+    AudioLimiter limiter;
+    uint64_t frame_clock = 0;
+    std::vector<uint32_t> finished;
+    gfxm::mat4 lis_transform = gfxm::mat4(1.0f);
+    // Parallel mix
+    static const size_t MIX_JOB_ROWS = 8;
+    AudioMixPool* mix_pool = 0;
+    int parallel_min_voices = 0;
+    std::vector<uint8_t> row_done;  // per row, set while mixing a block
+    size_t mix_frames = 0;
+    size_t bus_stride = 0;
+    gfxm::vec3 ears[2];
+    // 3d targets of every row for this block, see spatialize()
+    std::vector<float> spatial_target_l;
+    std::vector<float> spatial_target_r;
+    std::vector<float> spatial_target_lowpass;
+public:
+    AudioMixer() {
+        voices.init(AUDIO_MAX_VOICES);
+        finished.reserve(AUDIO_MAX_VOICES * 2);
+        row_done.resize(AUDIO_MAX_VOICES);
+        spatial_target_l.resize(AUDIO_MAX_VOICES);
+        spatial_target_r.resize(AUDIO_MAX_VOICES);
+        spatial_target_lowpass.resize(AUDIO_MAX_VOICES);
+        voice_generation.resize(AUDIO_MAX_VOICES);
+        voice_owner.resize(AUDIO_MAX_VOICES);
+        free_voices.reserve(AUDIO_MAX_VOICES);
+        for (uint32_t i = 0; i < AUDIO_MAX_VOICES; ++i) {
+            free_voices.push_back(AUDIO_MAX_VOICES - 1 - i);
         }
-
-        voice->front = &voice->buffer[0];
-        voice->back = &voice->buffer_back[0];
-        memset(voice->buffer, 0, sizeof(voice->buffer));
-    
-        
-        XAUDIO2_BUFFER buf = { 0 };
-        buf.AudioBytes = sizeof(voice->buffer);
-        buf.pAudioData = (BYTE*)voice->front;
-        buf.LoopCount = 0;
-        buf.pContext = voice;
-
-        hr = voice->pSourceVoice->SubmitSourceBuffer(&buf);
-        voice->pSourceVoice->Start(0, 0);
-    }
-    AudioVoiceData* createVoiceForSampleRate(int sampleRate) {
-        AudioVoiceData* voiceData = new AudioVoiceData;
-        createSourceVoice(voiceData, sampleRate);
-        voices.insert(std::make_pair(sampleRate, std::unique_ptr<AudioVoiceData>(voiceData)));
-        LOG("Created source voice for sample rate of " << sampleRate);
-        return voiceData;
-    }
-    AudioVoiceData* getVoiceDataBySampleRate(int sampleRate) {
-        AudioVoiceData* voiceData = 0;
-        auto it = voices.find(sampleRate);
-        if (it == voices.end()) {
-            voiceData = createVoiceForSampleRate(sampleRate);
-        } else {
-            voiceData = it->second.get();
+        for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+            bus_control[i] = AudioBusConfig::defaultFor(i);
         }
-        return voiceData;
     }
-public:
-    AudioMixer() {}
     void setListenerTransform(const gfxm::mat4& t) {
-        std::lock_guard<std::mutex> lock(sync);
-        lis_transform = t;
+        std::lock_guard<std::mutex> lock(control_sync);
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_LISTENER;
+        cmd.listener = t;
+        sendCommand(cmd);
     }
 
     Handle<AudioChannel> createChannel() {
-        return HANDLE_MGR<AudioChannel>::acquire();
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        Handle<AudioChannel> h = HANDLE_MGR<AudioChannel>::acquire();
+        if (!allocVoice(h)) {
+            LOG_WARN("Out of voices, channel will stay silent");
+        }
+        return h;
     }
     void freeChannel(Handle<AudioChannel> h) {
-        stop(h);
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        AudioChannel* ch = h.deref();
+        if (ch->voice != AUDIO_NO_VOICE) {
+            sendVoiceCommand(ch, AUDIO_CMD_STOP);
+            freeVoice(ch->voice);
+        }
+        deferRelease(ch->stream);
+        deferRelease(ch->buf_owner);
         HANDLE_MGR<AudioChannel>::release(h);
     }
 
     void play(Handle<AudioChannel> ch) {
-        auto vd = getVoiceDataBySampleRate(ch->buf->sampleRate());
-        vd->emitters.insert(ch);
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        startVoice(ch.deref(), false);
     }
     void play3d(Handle<AudioChannel> ch) {
-        auto vd = getVoiceDataBySampleRate(ch->buf->sampleRate());
-        vd->emitters3d.insert(ch);
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        startVoice(ch.deref(), true);
     }
     void stop(Handle<AudioChannel> ch) {
-        auto vd = getVoiceDataBySampleRate(ch->buf->sampleRate());
-        vd->emitters.erase(ch);
-        vd->emitters3d.erase(ch);
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        ch->playing = false;
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_STOP);
     }
     void resetCursor(Handle<AudioChannel> ch) {
-        HANDLE_MGR<AudioChannel>::deref(ch)->cursor = 0;
+        std::lock_guard<std::mutex> lock(control_sync);
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_RESET_CURSOR);
     }
 
     void setBuffer(Handle<AudioChannel> ch, AudioBuffer* buf) {
-        HANDLE_MGR<AudioChannel>::deref(ch)->buf = buf;
-        HANDLE_MGR<AudioChannel>::deref(ch)->cursor = 0;
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->buf = buf;
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_RESET_CURSOR);
+    }
+    // Streams are opened at the mixer rate, see AudioStreamer::open()
+    void setStream(Handle<AudioChannel> ch, const std::shared_ptr<AudioStream>& stream) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        std::shared_ptr<AudioStream> old = ch->stream;
+        ch->stream = stream;
+        attachStream(ch.deref());
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
+        deferRelease(old);
+    }
+    // Counted against that category's cap, takes effect on the next play
+    void setCategory(Handle<AudioChannel> ch, AUDIO_CATEGORY category, int priority = 0) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->category = category;
+        ch->priority = priority;
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
+    }
+    void setPolyphony(const AudioPolyphonyConfig& cfg) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        polyphony_control = cfg;
+        std::shared_ptr<AudioPolyphonyConfig> copy(new AudioPolyphonyConfig(cfg));
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_POLYPHONY;
+        cmd.polyphony = copy.get();
+        sendCommand(cmd);
+        deferRelease(copy);
+    }
+    AudioPolyphonyConfig getPolyphony() {
+        std::lock_guard<std::mutex> lock(control_sync);
+        return polyphony_control;
+    }
+    // Every voice is mixed into the bus of its category (see
+    // setCategory()), the buses are summed with their own fader
+    void setBus(AUDIO_CATEGORY category, const AudioBusConfig& cfg) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        bus_control[category] = cfg;
+        std::shared_ptr<AudioBusConfig> copy(new AudioBusConfig(cfg));
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_BUS;
+        cmd.bus.config = copy.get();
+        cmd.bus.category = category;
+        sendCommand(cmd);
+        deferRelease(copy);
+    }
+    AudioBusConfig getBus(AUDIO_CATEGORY category) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        return bus_control[category];
+    }
+
+    // Spreads the voices of a block over cfg.workers helper threads,
+    // for hundreds of voices at once. Worth it once a single core can't
+    // mix a block in time, see audio_bench. Takes effect on the next
+    // block if the mixer is running, otherwise at init()
+    void setParallelMix(const AudioParallelMixConfig& cfg) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        parallel_control = cfg;
+        if (buffer_f.empty()) {
+            return;
+        }
+        std::shared_ptr<AudioMixPool> pool;
+        if (cfg.workers > 0) {
+            pool.reset(new AudioMixPool(cfg, buses.size(), resample_buf.size()));
+        }
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_MIX_POOL;
+        cmd.mix_pool.pool = pool.get();
+        cmd.mix_pool.min_voices = cfg.min_voices;
+        sendCommand(cmd);
+        // The old pool's threads stop once the audio thread let go of it
+        deferRelease(mix_pool_control);
+        mix_pool_control = pool;
+    }
+    AudioParallelMixConfig getParallelMix() {
+        std::lock_guard<std::mutex> lock(control_sync);
+        return parallel_control;
+    }
+    // Helper threads actually running, workers is capped at cores - 1
+    int getParallelMixWorkers() {
+        std::lock_guard<std::mutex> lock(control_sync);
+        return mix_pool_control ? mix_pool_control->workerCount() : 0;
+    }
+
+    // Convolution reverb on the sum of the bus sends (reverb_send_db in
+    // setBus()), with ir as the impulse response. Its cost per block is
+    // set by the length of ir alone, see audio_bench. The response is
+    // prepared here, on the calling thread. Null ir turns it off.
+    // Only after init()
+    bool setReverb(const std::shared_ptr<AudioBuffer>& ir, const AudioReverbConfig& cfg = AudioReverbConfig()) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        if (buffer_f.empty()) {
+            LOG_ERR("Audio: reverb set before init");
+            return false;
+        }
+        pollEvents();
+        std::shared_ptr<AudioConvolver> reverb;
+        if (ir) {
+            int channels = 1;
+            std::vector<float> h = audioReverbImpulse(ir.get(), sampleRate, cfg.max_seconds, channels);
+            if (h.empty()) {
+                return false;
+            }
+            reverb.reset(new AudioConvolver);
+            reverb->init(h.data(), h.size() / channels, channels, buffering.block_frames);
+            LOG("Audio: reverb, " << (h.size() / channels * 1000 / sampleRate) << " ms, "
+                << reverb->partitionCount() << " partitions of " << reverb->blockSize());
+        }
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_REVERB;
+        cmd.reverb.convolver = reverb.get();
+        cmd.reverb.return_gain = powf(10.0f, cfg.return_db / 20.0f);
+        sendCommand(cmd);
+        deferRelease(reverb_control);
+        reverb_control = reverb;
+        return true;
+    }
+
+    // Master bus limiter, on by default at -1 dBFS
+    void setLimiter(const AudioLimiterConfig& cfg) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        std::shared_ptr<AudioLimiterConfig> copy(new AudioLimiterConfig(cfg));
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_LIMITER;
+        cmd.limiter = copy.get();
+        sendCommand(cmd);
+        deferRelease(copy);
+    }
+    void setCoalescing(const AudioCoalesceConfig& cfg) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        std::shared_ptr<AudioCoalesceConfig> copy(new AudioCoalesceConfig(cfg));
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_COALESCE;
+        cmd.coalesce = copy.get();
+        sendCommand(cmd);
+        deferRelease(copy);
+    }
+    void setSpatial(const AudioSpatialConfig& cfg) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        AudioCommand cmd = AudioCommand();
+        cmd.type = AUDIO_CMD_SPATIAL;
+        cmd.spatial = cfg;
+        sendCommand(cmd);
+    }
+    // Playback speed through the voice's resampler, 1.5 is 50% faster
+    // and a fifth higher. No effect on streams, their rate is set when
+    // they're opened (AudioStreamer::open())
+    void setRate(Handle<AudioChannel> ch, float rate) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->rate = audioClampRate(rate);
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
+    }
+    // Sinc by default, linear is cheaper but aliases
+    void setResampleQuality(Handle<AudioChannel> ch, AUDIO_RESAMPLE_QUALITY q) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->resample_quality = q;
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
+    }
+    // Default for new voices
+    void setResampleQuality(AUDIO_RESAMPLE_QUALITY q) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        resample_quality = q;
     }
     void setAttenuationRadius(Handle<AudioChannel> ch, float radius) {
-        HANDLE_MGR<AudioChannel>::deref(ch)->attenuation_radius = radius;
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->attenuation_radius = radius;
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
     }
     void setGain(Handle<AudioChannel> ch, float gain) {
-        HANDLE_MGR<AudioChannel>::deref(ch)->volume = gain;
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->volume = gain;
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
+    }
+    // [-1, 1], 2d voices only
+    void setPanning(Handle<AudioChannel> ch, float pan) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->panning = pan;
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
     }
     void setLooping(Handle<AudioChannel> ch, bool v) {
-        HANDLE_MGR<AudioChannel>::deref(ch)->looping = v;
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->looping = v;
+        if (ch->stream) {
+            ch->stream->setLooping(v);
+        }
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
     }
     void setPosition(Handle<AudioChannel> ch, const gfxm::vec3& pos) {
-        std::lock_guard<std::mutex> lock(sync);
-        HANDLE_MGR<AudioChannel>::deref(ch)->setPosition(pos);
+        std::lock_guard<std::mutex> lock(control_sync);
+        ch->setPosition(pos);
+        sendVoiceCommand(ch.deref(), AUDIO_CMD_UPDATE);
     }
 
     bool isPlaying(Handle<AudioChannel> ch) {
-        auto vd = getVoiceDataBySampleRate(ch->buf->sampleRate());
-        return vd->emitters.count(ch) || vd->emitters3d.count(ch);
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        return ch->playing;
     }
     bool isLooping(Handle<AudioChannel> ch) {
-        return HANDLE_MGR<AudioChannel>::deref(ch)->looping;
+        std::lock_guard<std::mutex> lock(control_sync);
+        return ch->looping;
     }
 
-    void playOnce(AudioBuffer* buf, float vol = 1.0f, float pan = .0f) {
-        Handle<AudioChannel> em = HANDLE_MGR<AudioChannel>::acquire();
-        HANDLE_MGR<AudioChannel>::deref(em)->buf = buf;
-        HANDLE_MGR<AudioChannel>::deref(em)->volume = vol;
-        HANDLE_MGR<AudioChannel>::deref(em)->panning = pan;
-        auto vd = getVoiceDataBySampleRate(buf->sampleRate());
-        vd->emitters.insert(em);
+    void playOnce(AudioBuffer* buf, float vol = 1.0f, float pan = .0f, AUDIO_CATEGORY category = AUDIO_CATEGORY_SFX, int priority = 0) {
+        startOneShot(buf, std::shared_ptr<void>(), vol, pan, category, priority);
     }
     void playOnce3d(AudioBuffer* buf, const gfxm::vec3& pos, float vol = 1.0f, float attenuation_radius = 10.0f) {
+        startOneShot3d(buf, std::shared_ptr<void>(), pos, vol, attenuation_radius);
+    }
+    // The mixer holds a reference until the sound is done,
+    // so caches can tell which buffers are still playing
+    // rate 2 plays twice as fast and an octave up, see setRate()
+    void playOnce(const std::shared_ptr<AudioBuffer>& buf, float vol = 1.0f, float pan = .0f, AUDIO_CATEGORY category = AUDIO_CATEGORY_SFX, int priority = 0, float rate = 1.0f) {
+        startOneShot(buf.get(), buf, vol, pan, category, priority, 0, rate);
+    }
+    // Starts exactly at frame start_frame of getSampleTime(), which can
+    // fall anywhere in a block. Right away if that has already passed
+    void playAt(const std::shared_ptr<AudioBuffer>& buf, uint64_t start_frame, float vol = 1.0f, float pan = .0f, AUDIO_CATEGORY category = AUDIO_CATEGORY_SFX, int priority = 0, float rate = 1.0f) {
+        startOneShot(buf.get(), buf, vol, pan, category, priority, start_frame, rate);
+    }
+    // Frames buf takes to play at the mixer rate, to line up playAt()s
+    uint64_t getPlayFrames(AudioBuffer* buf, float rate = 1.0f) const {
+        AudioResampler rs;
+        rs.init(buf->sampleRate(), sampleRate, AUDIO_RESAMPLE_LINEAR, audioClampRate(rate));
+        return rs.outputFrames(buf->sampleCount() / std::max(1, buf->channelCount()));
+    }
+    // Frames the audio thread has rendered, the clock playAt() goes by.
+    // Whatever the backend has queued is still to be heard
+    uint64_t getSampleTime() const {
+        return sample_time.load(std::memory_order_acquire);
+    }
+    void playOnce3d(const std::shared_ptr<AudioBuffer>& buf, const gfxm::vec3& pos, float vol = 1.0f, float attenuation_radius = 10.0f) {
+        startOneShot3d(buf.get(), buf, pos, vol, attenuation_radius);
+    }
+
+    // For music and other long clips, nothing is decoded up front.
+    // Open the stream with AudioStreamer::open() so it starts with data
+    void playStream(const std::shared_ptr<AudioStream>& stream, float vol = 1.0f, float pan = .0f, bool looping = false, AUDIO_CATEGORY category = AUDIO_CATEGORY_MUSIC, int priority = 0) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
         Handle<AudioChannel> em = HANDLE_MGR<AudioChannel>::acquire();
-        auto emp = HANDLE_MGR<AudioChannel>::deref(em);
-        emp->buf = buf;
+        AudioChannel* emp = em.deref();
+        emp->stream = stream;
         emp->volume = vol;
-        emp->setPosition(pos);
-        emp->attenuation_radius = attenuation_radius;
-        auto vd = getVoiceDataBySampleRate(buf->sampleRate());
-        vd->emitters3d.insert(em);
+        emp->panning = pan;
+        emp->looping = looping;
+        emp->category = category;
+        emp->priority = priority;
+        emp->one_shot = true;
+        if (!allocVoice(em)) {
+            LOG_WARN("Out of voices, dropping a stream");
+            HANDLE_MGR<AudioChannel>::release(em);
+            return;
+        }
+        stream->setLooping(looping);
+        attachStream(emp);
+        startVoice(emp, false);
+    }
+
+    // Per-block records from the audio thread, for one reader
+    // (see AudioStatsMonitor). Unread records are dropped, not queued
+    bool popBlockStats(AudioBlockStats& out) {
+        return block_stats.pop(out);
+    }
+    uint64_t getDroppedBlockStats() const {
+        return block_stats_dropped.load(std::memory_order_relaxed);
     }
 
+    // Releases finished one-shots. Also happens on every api call,
+    // call this periodically if the mixer can sit idle for a long time
+    void update() {
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+    }
+
+    int getSampleRate() const { return sampleRate; }
+    int getChannelCount() const { return nChannels; }
+    AudioBackend* getBackend() { return backend.get(); }
 
-    bool init(int sampleRate, int bps) {
+    const AudioBufferingConfig& getBuffering() const { return buffering; }
+
+    // Takes ownership of the backend, 0 picks the platform default
+    bool init(int sampleRate, int bps, AudioBackend* backend = 0, const AudioBufferingConfig& buffering = AudioBufferingConfig()) {
         this->sampleRate = sampleRate;
         this->bitPerSample = 32;
         this->nChannels = 2;
-        //memset(buffer, 0, sizeof(buffer));
-
-        gfxm::mat4 lis_transform = gfxm::mat4(1.0f);
-
-        HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-        if(FAILED(hr)) {
-            // NOTE: It's ok to fail here, means someone else already did it
-            //LOG_ERR("Failed to init COM: " << hr);
-            //return false;
-        }
-        #if(_WIN32_WINNT < 0x602)
-        #ifdef _DEBUG
-            HMODULE xAudioDll = LoadLibraryExW(L"XAudioD2_7.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
-        #else
-            HMODULE xAudioDll = LoadLibraryExW(L"XAudio2_7.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
-        #endif
-            if(!xAudioDll) {
-                LOG_ERR("Failed to find XAudio2.7 dll");
-                CoUninitialize();
-                return 1;
-            }
-        #endif
-        UINT32 flags = 0;
-        #if (_WIN32_WINNT < 0x0602 /*_WIN32_WINNT_WIN8*/) && defined(_DEBUG)
-            flags |= XAUDIO2_DEBUG_ENGINE;
-        #endif
-
-        hr = XAudio2Create(&pXAudio2, flags);
-        if(FAILED(hr)) {
-            LOG_ERR("Failed to init XAudio2: " << hr);
-            CoUninitialize();
-            return false;
+        this->buffering = buffering;
+        buffer_f.assign((size_t)buffering.block_frames * nChannels, .0f);
+        resample_buf.assign((size_t)buffering.block_frames * 4, .0f);
+        buses.init(sampleRate, buffering.block_frames);
+        for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+            buses.setConfig(i, bus_control[i]);
+        }
+        bus_stride = buses.stride();
+        limiter.init(sampleRate);
+        if (parallel_control.workers > 0) {
+            // Nothing is rendering yet
+            mix_pool_control.reset(new AudioMixPool(parallel_control, buses.size(), resample_buf.size()));
+            mix_pool = mix_pool_control.get();
+            parallel_min_voices = parallel_control.min_voices;
         }
 
-        if(FAILED(hr = pXAudio2->CreateMasteringVoice(&pMasteringVoice)))
-        {
-            LOG_ERR("Failed to create mastering voice: " << hr);
-            //pXAudio2.Reset();
-            CoUninitialize();
+        if (!backend) {
+            backend = audioCreateDefaultBackend();
+        }
+        this->backend.reset(backend);
+        if (!this->backend->init(sampleRate, nChannels, buffering, this)) {
+            LOG_ERR("Failed to init audio backend '" << this->backend->getName() << "'");
+            this->backend.reset();
             return false;
         }
-        pMasteringVoice->SetVolume(1.00f);
+        LOG("Audio backend: " << this->backend->getName() << ", mix kernels: " << audioMixKernels().name
+            << ", block: " << buffering.block_frames << " frames x " << buffering.queue_depth
+            << (buffering.adaptive ? " (adaptive)" : ""));
+        if (mix_pool) {
+            LOG("Audio: parallel mix, " << mix_pool->workerCount() << " workers from " << parallel_min_voices << " voices");
+        }
+        return true;
+    }
+    void cleanup() {
+        if (backend) {
+            backend->cleanup();
+            backend.reset();
+        }
+        mix_pool = 0;
+        mix_pool_control.reset();
+        buses.setReverb(0, 1.0f);
+        reverb_control.reset();
+    }
 
-        CoUninitialize();
+    // Called by the backend thread
+    void render(float* dst, size_t frame_count) override {
+        const size_t block_frames = (size_t)buffering.block_frames;
+        while (frame_count) {
+            size_t n = std::min(frame_count, block_frames);
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            AudioBlockStats st;
+            st.command_depth = (uint16_t)std::min<size_t>(commands.size(), UINT16_MAX);
+            applyCommands();
+            mixBlock(buffer_f.data(), n * nChannels);
+            st.peak = audioPeak(buffer_f.data(), n * nChannels);
+            if (limiter.getConfig().enabled) {
+                limiter.process(buffer_f.data(), n);
+            }
+            memcpy(dst, buffer_f.data(), n * nChannels * sizeof(float));
+            st.process_ns = (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - t0
+            ).count();
+            st.frames = (uint32_t)n;
+            st.voices = (uint16_t)voices.size();
+            if (!block_stats.push(st)) {
+                block_stats_dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            dst += n * nChannels;
+            frame_count -= n;
+        }
+    }
+private:
+    // === Control side, control_sync held ===
 
+    bool allocVoice(Handle<AudioChannel> h) {
+        if (free_voices.empty()) {
+            return false;
+        }
+        uint32_t v = free_voices.back();
+        free_voices.pop_back();
+        AudioChannel* ch = h.deref();
+        ch->voice = v;
+        voice_owner[v] = h;
+        sendVoiceCommand(ch, AUDIO_CMD_INIT);
         return true;
     }
-    void cleanup() {
-        pXAudio2->StopEngine();
-        pXAudio2->Release();
-    }
-
-    void __stdcall OnStreamEnd() {   }
-
-    //Unused methods are stubs
-    void __stdcall OnVoiceProcessingPassEnd() { }
-    void __stdcall OnVoiceProcessingPassStart(UINT32 SamplesRequired) {    }
-    void __stdcall OnBufferEnd(void * pBufferContext) {
-        AudioVoiceData* pVoiceData = (AudioVoiceData*)pBufferContext;
-
-        gfxm::mat4 lis_trans_copy;
-        {
-            std::lock_guard<std::mutex> lock(sync);
-            lis_trans_copy = lis_transform;
-        }
-
-        memset(pVoiceData->buffer_f, 0, sizeof(pVoiceData->buffer_f));
-        memset(pVoiceData->back, 0, sizeof(pVoiceData->buffer));
-        size_t buf_len = sizeof(pVoiceData->buffer_f) / sizeof(pVoiceData->buffer_f[0]);
-        for(auto it = pVoiceData->emitters.begin(); it != pVoiceData->emitters.end();) {
-            Handle<AudioChannel> ei = (*it);
-            ++it;
-            AudioChannel* em = HANDLE_MGR<AudioChannel>::deref(ei);
-            if(!em->buf) {
-                pVoiceData->emitters.erase(ei);
-                HANDLE_MGR<AudioChannel>::release(ei);
+    void freeVoice(uint32_t v) {
+        // Stale events for the old owner get ignored by generation
+        ++voice_generation[v];
+        voice_owner[v] = Handle<AudioChannel>();
+        free_voices.push_back(v);
+    }
+    void startOneShot(AudioBuffer* buf, const std::shared_ptr<void>& owner, float vol, float pan, AUDIO_CATEGORY category, int priority, uint64_t start_frame = 0, float rate = 1.0f) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        Handle<AudioChannel> em = HANDLE_MGR<AudioChannel>::acquire();
+        AudioChannel* emp = em.deref();
+        emp->buf = buf;
+        emp->buf_owner = owner;
+        emp->volume = vol;
+        emp->panning = pan;
+        emp->category = category;
+        emp->priority = priority;
+        emp->start_frame = start_frame;
+        emp->rate = audioClampRate(rate);
+        emp->resample_quality = resample_quality;
+        emp->one_shot = true;
+        if (!allocVoice(em)) {
+            LOG_WARN("Out of voices, dropping a sound");
+            HANDLE_MGR<AudioChannel>::release(em);
+            return;
+        }
+        startVoice(emp, false);
+    }
+    void startOneShot3d(AudioBuffer* buf, const std::shared_ptr<void>& owner, const gfxm::vec3& pos, float vol, float attenuation_radius) {
+        std::lock_guard<std::mutex> lock(control_sync);
+        pollEvents();
+        Handle<AudioChannel> em = HANDLE_MGR<AudioChannel>::acquire();
+        AudioChannel* emp = em.deref();
+        emp->buf = buf;
+        emp->buf_owner = owner;
+        emp->volume = vol;
+        emp->setPosition(pos);
+        emp->attenuation_radius = attenuation_radius;
+        emp->resample_quality = resample_quality;
+        emp->one_shot = true;
+        if (!allocVoice(em)) {
+            LOG_WARN("Out of voices, dropping a sound");
+            HANDLE_MGR<AudioChannel>::release(em);
+            return;
+        }
+        startVoice(emp, true);
+    }
+    void startVoice(AudioChannel* ch, bool is3d) {
+        if (ch->voice == AUDIO_NO_VOICE || (!ch->buf && !ch->stream)) {
+            return;
+        }
+        ch->is3d = is3d;
+        ch->playing = true;
+        // Finish events from an earlier play of this channel are stale now
+        ++voice_generation[ch->voice];
+        sendVoiceCommand(ch, AUDIO_CMD_PLAY);
+    }
+    void sendVoiceCommand(AudioChannel* ch, AUDIO_CMD type) {
+        if (ch->voice == AUDIO_NO_VOICE) {
+            return;
+        }
+        AudioCommand cmd = AudioCommand();
+        cmd.type = type;
+        cmd.voice = ch->voice;
+        cmd.generation = voice_generation[ch->voice];
+        if (type == AUDIO_CMD_PLAY || type == AUDIO_CMD_UPDATE) {
+            AudioVoiceParams& p = cmd.params;
+            p.buf = ch->buf;
+            p.stream = ch->stream.get();
+            p.category = (uint8_t)ch->category;
+            p.priority = (int8_t)std::max(-128, std::min(127, ch->priority));
+            if (ch->buf) {
+                p.resampler.init(ch->buf->sampleRate(), sampleRate, ch->resample_quality, ch->rate);
+            }
+            p.volume = ch->volume;
+            p.panning = ch->panning;
+            p.attenuation_radius = ch->attenuation_radius;
+            p.pos = ch->pos;
+            p.looping = ch->looping;
+            p.is3d = ch->is3d;
+            p.start_frame = ch->start_frame;
+        }
+        sendCommand(cmd);
+    }
+    void sendCommand(const AudioCommand& cmd) {
+        // Only blocks if the audio thread is more than a ring behind
+        while (!commands.push(cmd)) {
+            std::this_thread::yield();
+        }
+        ++commands_sent;
+    }
+    void attachStream(AudioChannel* ch) {
+        if (!ch->stream) {
+            return;
+        }
+        // Never decoded here, the caller may be the IRC thread. A stream
+        // that wasn't primed plays silence until the streamer gets to it
+        audioStreamer().add(ch->stream);
+    }
+    void deferRelease(const std::shared_ptr<void>& ptr) {
+        if (ptr) {
+            graveyard.push_back(std::make_pair(commands_sent, ptr));
+        }
+    }
+    void pollEvents() {
+        uint64_t applied = commands_applied.load(std::memory_order_acquire);
+        for (size_t i = 0; i < graveyard.size();) {
+            if (graveyard[i].first <= applied) {
+                graveyard[i] = graveyard.back();
+                graveyard.pop_back();
                 continue;
             }
+            ++i;
+        }
 
-            size_t src_cur = em->cursor;
-            short* data = em->buf->getPtr();
-            size_t src_len = em->buf->sampleCount();
-            int sample_rate = em->buf->sampleRate();
-            int channel_count = em->buf->channelCount();
-            bool looping = em->looping;
-            
-            size_t advance = 0;
-            if (channel_count == 2) {
-                advance = mix(
-                    pVoiceData->buffer_f, buf_len, data, src_len,
-                    src_cur, em->volume, em->panning,
-                    looping
-                );
-            } else if (channel_count == 1) {
-                advance = mix_mono_(
-                    pVoiceData->buffer_f, buf_len,
-                    data, src_len, src_cur, sample_rate,
-                    em->volume, looping
-                );
-                /*
-                advance = mix_mono(
-                    buffer_f, buf_len, data, src_len,
-                    src_cur, em->volume, em->panning,
-                    looping
-                );*/
-            }
-            
-            em->cursor += advance;
-            if(em->cursor >= em->buf->sampleCount()) {
-                if(!em->looping) {
-                    pVoiceData->emitters.erase(ei);
-                    HANDLE_MGR<AudioChannel>::release(ei);
-                    continue;
-                }
-            } 
-            em->cursor = em->cursor % src_len;
-        }
-        for(auto it = pVoiceData->emitters3d.begin(); it != pVoiceData->emitters3d.end();) {
-            Handle<AudioChannel> ei = (*it);
-            ++it;
-            AudioChannel* em = HANDLE_MGR<AudioChannel>::deref(ei);
-            if(!em->buf) {
-                pVoiceData->emitters3d.erase(ei);
+        AudioEvent e;
+        while (events.pop(e)) {
+            if (e.generation != voice_generation[e.voice]) {
                 continue;
             }
+            Handle<AudioChannel> h = voice_owner[e.voice];
+            AudioChannel* ch = h.deref();
+            ch->playing = false;
+            if (ch->one_shot) {
+                freeVoice(e.voice);
+                HANDLE_MGR<AudioChannel>::release(h);
+            }
+        }
+    }
 
-            gfxm::vec3 p_;
-            {
-                std::lock_guard<std::mutex> lock(sync);
-                p_ = em->pos;
-            }
-            
-            size_t src_cur = em->cursor;
-            short* data = em->buf->getPtr();
-            size_t src_len = em->buf->sampleCount();
-            int src_sample_rate = em->buf->sampleRate();
-            int src_channel_count = em->buf->channelCount();
-            bool looping = em->looping;
-
-            size_t advance = 0;
-            if (src_channel_count == 2) {/*
-                advance = mix3d(
-                    buffer_f, buf_len,
-                    em->buf->getPtr(),
-                    em->buf->sampleCount(),
-                    em->cursor, em->buf->channelCount(), em->volume,
-                    p_,
-                    lis_trans_copy
-                );*/
-                advance = mix3d_stereo(
-                    pVoiceData->buffer_f, buf_len,
-                    data, src_len, src_cur, src_sample_rate,
-                    em->volume, em->attenuation_radius, looping, p_, lis_trans_copy
-                );
-            } else if(src_channel_count == 1) {
-                advance = mix3d_mono(
-                    pVoiceData->buffer_f, buf_len,
-                    data, src_len, src_cur, src_sample_rate,
-                    em->volume, em->attenuation_radius, looping, p_, lis_trans_copy
-                );
-            }
-
-            em->cursor += advance;
-            if(em->cursor >= em->buf->sampleCount()) {
-                if(!em->looping) {
-                    pVoiceData->emitters3d.erase(ei);
+    // === Audio thread ===
+
+    void applyCommands() {
+        AudioCommand cmd;
+        uint64_t applied = 0;
+        while (commands.pop(cmd)) {
+            ++applied;
+            if (cmd.type == AUDIO_CMD_LISTENER) {
+                lis_transform = cmd.listener;
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_POLYPHONY) {
+                polyphony = *cmd.polyphony;
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_COALESCE) {
+                coalesce = *cmd.coalesce;
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_SPATIAL) {
+                spatial = cmd.spatial;
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_LIMITER) {
+                limiter.setConfig(*cmd.limiter);
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_BUS) {
+                buses.setConfig(cmd.bus.category, *cmd.bus.config);
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_MIX_POOL) {
+                mix_pool = cmd.mix_pool.pool;
+                parallel_min_voices = cmd.mix_pool.min_voices;
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_REVERB) {
+                buses.setReverb(cmd.reverb.convolver, cmd.reverb.return_gain);
+                continue;
+            }
+            AudioVoiceTable::Slot& v = voices.slots[cmd.voice];
+            if (cmd.type == AUDIO_CMD_INIT) {
+                voices.reset(cmd.voice, cmd.generation);
+                continue;
+            }
+            if (cmd.type == AUDIO_CMD_PLAY) {
+                // Every play starts a new generation,
+                // a pending finish from the previous one is stale
+                v.generation = cmd.generation;
+                v.finish_pending = false;
+            } else if (cmd.generation != v.generation) {
+                continue;
+            }
+            switch (cmd.type) {
+            case AUDIO_CMD_PLAY:
+                voices.setParams(cmd.voice, cmd.params);
+                if (!voices.isActive(cmd.voice)) {
+                    if (coalesceVoice(cmd.params)) {
+                        // Heard through another voice, this one is done
+                        finish(cmd.voice);
+                        break;
+                    }
+                    if (!admitVoice(cmd.params)) {
+                        // Everything in the way outranks it
+                        finish(cmd.voice);
+                        break;
+                    }
+                    voices.activate(cmd.voice);
+                    voices.start[v.row] = std::max(frame_clock, cmd.params.start_frame);
+                } else {
+                    // Played again while it was being stolen
+                    voices.fade[v.row] = 1.0f;
+                    voices.fade_step[v.row] = .0f;
                 }
+                break;
+            case AUDIO_CMD_STOP:
+                voices.deactivate(cmd.voice);
+                break;
+            case AUDIO_CMD_UPDATE:
+                voices.setParams(cmd.voice, cmd.params);
+                break;
+            case AUDIO_CMD_RESET_CURSOR:
+                voices.resetCursor(cmd.voice);
+                break;
+            default:
+                break;
             }
-            em->cursor = em->cursor % em->buf->sampleCount();
         }
-
-        for(int i = 0; i < AUDIO_BUFFER_SZ; ++i) {
-            //samplef = pow(samplef, pow_) * sign;
-            pVoiceData->back[i] = pVoiceData->buffer_f[i];// gfxm::_min(1.0f, (buffer_f[i] * 0.5f));
+        if (applied) {
+            commands_applied.fetch_add(applied, std::memory_order_release);
         }
 
-        float* tmp = pVoiceData->front;
-        pVoiceData->front = pVoiceData->back;
-        pVoiceData->back = tmp;
-        
-        XAUDIO2_BUFFER buf = { 0 };
-        buf.AudioBytes = sizeof(pVoiceData->buffer);
-        buf.pAudioData = (BYTE*)pVoiceData->front;
-        buf.LoopCount = 0;
-        buf.pContext = pVoiceData;
-        pVoiceData->pSourceVoice->SubmitSourceBuffer(&buf);
+        // Retry finish events that didn't fit last time
+        for (size_t i = 0; i < finished.size();) {
+            AudioVoiceTable::Slot& v = voices.slots[finished[i]];
+            if (!v.finish_pending) {
+                finished[i] = finished.back();
+                finished.pop_back();
+                continue;
+            }
+            if (!events.push(AudioEvent{ AUDIO_EVT_VOICE_FINISHED, finished[i], v.generation })) {
+                break;
+            }
+            v.finish_pending = false;
+            finished[i] = finished.back();
+            finished.pop_back();
+        }
     }
-    void __stdcall OnBufferStart(void * pBufferContext) {    }
-    void __stdcall OnLoopEnd(void * pBufferContext) {
-        
+    void finish(uint32_t idx) {
+        voices.deactivate(idx);
+        AudioVoiceTable::Slot& v = voices.slots[idx];
+        if (!events.push(AudioEvent{ AUDIO_EVT_VOICE_FINISHED, idx, v.generation }) && !v.finish_pending) {
+            v.finish_pending = true;
+            finished.push_back(idx);
+        }
     }
-    void __stdcall OnVoiceError(void * pBufferContext, HRESULT Error) {
-        LOG("Voice error: " << Error);
-     }
-private:
-    size_t mix(
-        float* dest, 
-        size_t dest_len, 
-        short* src, 
-        size_t src_len,
-        size_t cur,
-        float vol,
-        float panning,
-        bool looping
-    ) {
-        size_t sample_len = src_len < dest_len ? src_len : dest_len;
-        size_t overflow = (cur + sample_len) > src_len ? (cur + sample_len) - src_len : 0;
 
-        size_t tgt0sz = sample_len - overflow;
-        size_t tgt1sz = overflow;
-        short* tgt0 = src + cur;
-        short* tgt1 = src;
+    void mixBlock(float* dst, size_t buf_len) {
+        const size_t dst_frames = buf_len / nChannels;
+        buses.clear();
 
-        float mul = 1.0f / (float)SHORT_MAX;
+        ears[0] = lis_transform * gfxm::vec4(gfxm::vec3(-0.1075f, .0f, .0f), 1.0f);
+        ears[1] = lis_transform * gfxm::vec4(gfxm::vec3(0.1075f, .0f, .0f), 1.0f);
+        mix_frames = dst_frames;
 
-        for(size_t i = 0; i < tgt0sz; ++i) {
-            int lr = (i % 2) * 2 - 1;
-            float pan = std::min(fabs(lr + panning), 1.0f);
-            
-            dest[i] += tgt0[i] * mul * vol * pan;
+        const size_t rows = voices.size();
+        spatialize(rows);
+        if (mix_pool && mix_pool->workerCount() && rows >= (size_t)std::max(parallel_min_voices, 1)) {
+            // The sum comes out in a different order than mixing on one
+            // thread, so the output differs in the last bits
+            mix_pool->run(&mixJob, this, (rows + MIX_JOB_ROWS - 1) / MIX_JOB_ROWS, buses.buffer(), resample_buf.data(), buses.size());
+        } else {
+            mixRows(buses.buffer(), resample_buf.data(), 0, rows);
         }
-
-        if (!looping) {
-            return sample_len;
+        // finish() swap-removes, going backwards the row moved
+        // into a finished one has been looked at already
+        for (size_t row = rows; row-- > 0;) {
+            if (row_done[row]) {
+                finish(voices.slot[row]);
+            }
         }
+        buses.mixdown(dst, dst_frames);
+        frame_clock += dst_frames;
+        sample_time.store(frame_clock, std::memory_order_release);
+    }
+    // Gains and low-pass targets of all rows in one go, 2d rows included
+    // (it's cheaper than picking the 3d ones out), only 3d ones use them
+    void spatialize(size_t rows) {
+        const float ear_l[3] = { ears[0].x, ears[0].y, ears[0].z };
+        const float ear_r[3] = { ears[1].x, ears[1].y, ears[1].z };
+        audioSpatialGains(
+            voices.pos_x.data(), voices.pos_y.data(), voices.pos_z.data(),
+            voices.attenuation_radius.data(), voices.gain.data(), rows,
+            ear_l, ear_r, spatial.air_absorption,
+            spatial_target_l.data(), spatial_target_r.data(), spatial_target_lowpass.data()
+        );
+    }
+    static void mixJob(void* ctx, size_t item, float* dst, float* scratch) {
+        AudioMixer* mixer = (AudioMixer*)ctx;
+        size_t begin = item * MIX_JOB_ROWS;
+        mixer->mixRows(dst, scratch, begin, std::min(begin + MIX_JOB_ROWS, mixer->voices.size()));
+    }
+    // Mixes rows [begin, end) into their buses in dst (laid out like
+    // AudioBusMix) and flags the ones that are done in row_done. Rows
+    // don't share state, so ranges can be mixed on different threads,
+    // each with its own dst and scratch
+    void mixRows(float* bus_dst, float* scratch, size_t begin, size_t end) {
+        for (size_t row = begin; row < end; ++row) {
+            float* dst = bus_dst + voices.category[row] * bus_stride;
+            size_t dst_frames = mix_frames;
+            AudioBuffer* buf = voices.buf[row];
+            if (!voices.stream[row] && (!buf || buf->sampleCount() == 0)) {
+                row_done[row] = 1;
+                continue;
+            }
+            if (voices.start[row] > frame_clock) {
+                // Scheduled with playAt(), starts mid block or later
+                row_done[row] = 0;
+                if (voices.start[row] - frame_clock >= dst_frames) {
+                    continue;
+                }
+                size_t offset = (size_t)(voices.start[row] - frame_clock);
+                dst += offset * 2;
+                dst_frames -= offset;
+            }
+            if (row + 1 < end && voices.buf[row + 1] && !voices.stream[row + 1]) {
+                // Source data is the one thing not in the table
+                AudioBuffer* next = voices.buf[row + 1];
+                AUDIO_PREFETCH((const char*)next->getData() + (voices.cursor[row + 1] >> AUDIO_FRAC_BITS) * next->channelCount() * next->sampleSize());
+            }
 
-        for(size_t i = 0; i < tgt1sz; ++i) {
-            int lr = (i % 2) * 2 - 1;
-            float pan = std::min(fabs(lr + panning), 1.0f);
-            (dest + tgt0sz)[i] += tgt1[i] * mul * vol * pan;
+            bool playing = true;
+            if (!(voices.flags[row] & AUDIO_VOICE_3D)) {
+                float gain_l, gain_r;
+                audioPanGains(audioMixGain(voices.gain[row]), voices.pan[row], gain_l, gain_r);
+                playing = mixRow<false>(dst, scratch, dst_frames, row, gain_l, gain_r);
+            } else {
+                playing = mixRow3d(dst, scratch, dst_frames, row);
+            }
+            row_done[row] = playing ? 0 : 1;
         }
+    }
 
-        return sample_len;
+    // Within about half a semitone, a repeat's random pitch variation
+    // still counts as the same sound, speed=2 doesn't
+    static bool similarPitch(uint64_t step_a, uint64_t step_b) {
+        const uint64_t d = step_a > step_b ? step_a - step_b : step_b - step_a;
+        return d <= std::min(step_a, step_b) / 32;
     }
-    size_t mix_mono_(
-        float* dst, size_t dst_len,
-        short* src, size_t src_len,
-        size_t src_cur, int src_sampleRate,
-        float gain, bool looping
-    ) {
-        constexpr int dst_channelCount = 2;
-        constexpr float flt_convert = 1.0f / (float)SHORT_MAX;
-        float sampleRatio = src_sampleRate / (float)this->sampleRate;
-        int invSampleRatio = this->sampleRate / src_sampleRate;
-        
-        // TODO: Handle non-looping
-        // (don't emit wrapped around samples)
-        if (dst_channelCount == 2) {
-            for (int di = 0; di < dst_len; di += dst_channelCount) {
-                int si = (src_cur + di / 2) % src_len;
-                float s = src[si] * flt_convert * gain;
-                dst[di    ] += s;
-                dst[di + 1] += s;
+    // True if p was merged into a voice that just started on the same buffer
+    bool coalesceVoice(const AudioVoiceParams& p) {
+        if (!coalesce.enabled || !p.buf || p.stream || p.looping || p.is3d || p.start_frame > frame_clock) {
+            return false;
+        }
+        const uint64_t window = (uint64_t)(coalesce.window_seconds * sampleRate);
+        const uint64_t min_offset = (uint64_t)(coalesce.min_offset_seconds * sampleRate);
+        int count = 0;
+        int latest = -1;
+        for (size_t row = 0; row < voices.size(); ++row) {
+            if (voices.buf[row] != p.buf
+                || !similarPitch(voices.resampler[row].step, p.resampler.step)
+                || voices.stream[row]
+                || (voices.flags[row] & (AUDIO_VOICE_LOOPING | AUDIO_VOICE_3D))
+                || voices.fade_step[row] != .0f
+                || frame_clock - voices.start[row] >= window
+            ) {
+                continue;
+            }
+            ++count;
+            if (latest < 0 || voices.start[row] > voices.start[latest]) {
+                latest = (int)row;
             }
-        } else {
-            // TODO
         }
-
-        return dst_len / dst_channelCount;
+        if (latest < 0
+            || (count < coalesce.max_voices && frame_clock - voices.start[latest] >= min_offset)
+        ) {
+            return false;
+        }
+        // Copies of one sound a few ms apart add up about like noise does
+        float g = voices.gain[latest];
+        float merged = std::max(g, std::min(sqrtf(g * g + p.volume * p.volume), coalesce.max_gain));
+        voices.gain[latest] = merged;
+        return true;
     }
-    size_t mix_mono(
-        float* dest, 
-        size_t dest_len, 
-        short* src, 
-        size_t src_len,
-        size_t cur,
-        float vol,
-        float panning,
-        bool looping
-    ) {
-        size_t sample_len = src_len < (dest_len / 2) ? src_len : (dest_len / 2);
-        size_t overflow = (cur + sample_len) > src_len ? (cur + sample_len) - src_len : 0;
 
-        size_t src0sz = sample_len - overflow;
-        size_t src1sz = overflow;
-        short* src0 = src + cur;
-        short* src1 = src;
+    // Makes room for a voice that is about to start. False if it's over
+    // a cap and every voice that could make room outranks it
+    bool admitVoice(const AudioVoiceParams& p) {
+        int total = 0;
+        int in_category = 0;
+        int fading = 0;
+        for (size_t row = 0; row < voices.size(); ++row) {
+            if (voices.fade_step[row] != .0f) {
+                ++fading;
+                continue;
+            }
+            ++total;
+            if (voices.category[row] == p.category) {
+                ++in_category;
+            }
+        }
+        if (in_category >= polyphony.category_max[p.category]) {
+            if (!steal(p.category, p.priority, fading)) {
+                return false;
+            }
+            --total;
+        }
+        if (total >= polyphony.max_voices) {
+            if (!steal(-1, p.priority, fading)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    // category -1 is any
+    bool steal(int category, int priority, int& fading) {
+        int victim = -1;
+        for (size_t row = 0; row < voices.size(); ++row) {
+            if (voices.fade_step[row] != .0f
+                || voices.priority[row] > priority
+                || (category >= 0 && voices.category[row] != category)
+            ) {
+                continue;
+            }
+            if (victim < 0 || voices.priority[row] < voices.priority[victim]) {
+                victim = (int)row;
+                continue;
+            }
+            if (voices.priority[row] > voices.priority[victim]) {
+                continue;
+            }
+            bool better = polyphony.steal == AUDIO_STEAL_QUIETEST
+                ? voices.level[row] < voices.level[victim]
+                : voices.start[row] < voices.start[victim];
+            if (better) {
+                victim = (int)row;
+            }
+        }
+        if (victim < 0) {
+            return false;
+        }
+        if (fading >= polyphony.max_fading || polyphony.fade_seconds <= .0f) {
+            finish(voices.slot[victim]);
+            return true;
+        }
+        voices.fade_step[victim] = 1.0f / (polyphony.fade_seconds * sampleRate);
+        ++fading;
+        return true;
+    }
 
-        float mul = 1.0f / (float)SHORT_MAX;
+    // Stolen voices fade out linearly, in steps short enough not to click
+    template<bool DOWNMIX>
+    bool mixRow(float* dst, float* scratch, size_t dst_frames, size_t row, float gain_l, float gain_r) {
+        voices.level[row] = std::max(gain_l, gain_r);
+        if (voices.fade_step[row] == .0f) {
+            return mixVoice<DOWNMIX>(dst, scratch, dst_frames, row, gain_l, gain_r);
+        }
+        const size_t FADE_STEP_FRAMES = 16;
+        for (size_t done = 0; done < dst_frames;) {
+            size_t n = std::min(FADE_STEP_FRAMES, dst_frames - done);
+            float f = voices.fade[row];
+            if (f <= .0f || !mixVoice<DOWNMIX>(dst + done * 2, scratch, n, row, gain_l * f, gain_r * f)) {
+                return false;
+            }
+            voices.fade[row] = f - voices.fade_step[row] * n;
+            done += n;
+        }
+        return voices.fade[row] > .0f;
+    }
 
-        for(size_t i = 0; i < src0sz; ++i) {
-            int lr = (i % 2) * 2 - 1;
-            float pan = std::min(fabs(lr + panning), 1.0f);
-            
-            dest[i * 2] += src0[i] * mul * vol * pan;
-            dest[i * 2 + 1] += src0[i] * mul * vol * pan;
+    // 3d voices are mixed down to mono in scratch, then low-passed and
+    // spread to the ears with the coefficient and the gains ramping
+    // from where the last block left them to this block's targets
+    bool mixRow3d(float* dst, float* scratch, size_t dst_frames, size_t row) {
+        const float to_l = spatial_target_l[row];
+        const float to_r = spatial_target_r[row];
+        const float to_lowpass = spatial_target_lowpass[row];
+        voices.level[row] = std::max(to_l, to_r);
+        if (voices.spatial_l[row] < .0f) {
+            voices.spatial_l[row] = to_l;
+            voices.spatial_r[row] = to_r;
+            voices.lowpass[row] = to_lowpass;
+        }
+        // Being stolen, the fade goes into the ramp
+        float fade_from = 1.0f;
+        float fade_to = 1.0f;
+        size_t frames = dst_frames;
+        if (voices.fade_step[row] != .0f) {
+            fade_from = voices.fade[row];
+            if (fade_from <= .0f) {
+                return false;
+            }
+            fade_to = fade_from - voices.fade_step[row] * dst_frames;
+            if (fade_to <= .0f) {
+                frames = std::min(dst_frames, (size_t)ceilf(fade_from / voices.fade_step[row]));
+                fade_to = .0f;
+            }
+            voices.fade[row] = fade_to;
         }
 
-        if (!looping) {
-            return sample_len;
+        if (voices.lowpass[row] == 1.0f && to_lowpass == 1.0f && fade_from == fade_to
+            && voices.spatial_l[row] == to_l && voices.spatial_r[row] == to_r
+        ) {
+            // Inside its radius and not moving, straight into the bus
+            return mixVoice<true>(dst, scratch, frames, row, to_l, to_r);
         }
+        float* mono = scratch + (size_t)buffering.block_frames * 2;
+        memset(mono, 0, frames * 2 * sizeof(float));
+        const bool playing = mixVoice<true>(mono, scratch, frames, row, 1.0f, .0f);
+        audioMixLowpassRampF32(
+            dst, mono, frames, voices.lowpass_z[row],
+            voices.lowpass[row], to_lowpass,
+            voices.spatial_l[row] * fade_from, to_l * fade_to,
+            voices.spatial_r[row] * fade_from, to_r * fade_to
+        );
+        voices.spatial_l[row] = to_l;
+        voices.spatial_r[row] = to_r;
+        voices.lowpass[row] = to_lowpass;
+        return playing && fade_to > .0f;
+    }
 
-        for(size_t i = 0; i < src1sz; ++i) {
-            int lr = (i % 2) * 2 - 1;
-            float pan = std::min(fabs(lr + panning), 1.0f);
-            (dest + src0sz * 2)[i * 2] += src1[i] * mul * vol * pan;
-            (dest + src0sz * 2)[i * 2 + 1] += src1[i] * mul * vol * pan;
+    // Picks the mixing path for the source layout, DOWNMIX sums stereo
+    // sources to mono before applying the gains (3d).
+    // Returns false once a non-looping voice has played out
+    template<bool DOWNMIX>
+    bool mixVoice(float* dst, float* scratch, size_t dst_frames, size_t row, float gain_l, float gain_r) {
+        if (voices.stream[row]) {
+            return mixStream<DOWNMIX>(dst, scratch, dst_frames, row, gain_l, gain_r);
+        }
+        const bool looping = (voices.flags[row] & AUDIO_VOICE_LOOPING) != 0;
+        if (voices.buf[row]->channelCount() == 2) {
+            if (looping) {
+                return mixVoice<2, true, DOWNMIX>(dst, scratch, dst_frames, row, gain_l, gain_r);
+            } else {
+                return mixVoice<2, false, DOWNMIX>(dst, scratch, dst_frames, row, gain_l, gain_r);
+            }
+        } else if (voices.buf[row]->channelCount() == 1) {
+            if (looping) {
+                return mixVoice<1, true, DOWNMIX>(dst, scratch, dst_frames, row, gain_l, gain_r);
+            } else {
+                return mixVoice<1, false, DOWNMIX>(dst, scratch, dst_frames, row, gain_l, gain_r);
+            }
+        }
+        // Unsupported layout
+        return false;
+    }
+    template<int SRC_CHANNELS, bool LOOPING, bool DOWNMIX>
+    bool mixVoice(float* dst, float* scratch, size_t dst_frames, size_t row, float gain_l, float gain_r) {
+        AudioBuffer* buf = voices.buf[row];
+        if (buf->sampleFormat() == AUDIO_SAMPLE_F32) {
+            // Gains are scaled for s16 sources
+            return mixVoice<SRC_CHANNELS, LOOPING, DOWNMIX>(
+                dst, scratch, dst_frames, row, (const float*)buf->getData(), gain_l * SHORT_MAX, gain_r * SHORT_MAX
+            );
+        }
+        return mixVoice<SRC_CHANNELS, LOOPING, DOWNMIX>(
+            dst, scratch, dst_frames, row, (const short*)buf->getData(), gain_l, gain_r
+        );
+    }
+    template<int SRC_CHANNELS, bool LOOPING, bool DOWNMIX, typename T>
+    bool mixVoice(float* dst, float* scratch, size_t dst_frames, size_t row, const T* src, float gain_l, float gain_r) {
+        const size_t src_frames = voices.buf[row]->sampleCount() / SRC_CHANNELS;
+        const AudioResampler& rs = voices.resampler[row];
+        uint64_t& pos = voices.cursor[row];
+
+        if (rs.isPassthrough(pos)) {
+            // Same rate, mix straight from the clip
+            size_t cur = (size_t)(pos >> AUDIO_FRAC_BITS);
+            cur += mixSpans<SRC_CHANNELS, LOOPING, DOWNMIX>(
+                dst, dst_frames, src, src_frames, cur, gain_l, gain_r
+            );
+            if (cur >= src_frames) {
+                if (!LOOPING) {
+                    return false;
+                }
+                cur = cur % src_frames;
+            }
+            pos = (uint64_t)cur << AUDIO_FRAC_BITS;
+            return true;
         }
 
-        return sample_len;
+        size_t n = audioResample<SRC_CHANNELS, LOOPING>(
+            rs, scratch, dst_frames, src, src_frames, pos
+        );
+        AudioMixSpan<SRC_CHANNELS, DOWNMIX>::getF32(audioMixKernels())(dst, scratch, n, gain_l, gain_r);
+        return LOOPING || (pos >> AUDIO_FRAC_BITS) < src_frames;
     }
-    size_t mix3d_stereo(
-        float* dst, size_t dst_len,
-        short* src, size_t src_len,
-        size_t src_cur, int src_sampleRate,
-        float gain, float atten_radius, bool looping,
-        const gfxm::vec3& pos,
-        const gfxm::mat4& listener_transform
-    ) {
-        constexpr int dst_channelCount = 2;
-        constexpr float flt_convert = 1.0f / (float)SHORT_MAX;
-        float sampleRatio = src_sampleRate / (float)this->sampleRate;
-        int invSampleRatio = this->sampleRate / src_sampleRate;
-
-        gfxm::vec3 ears[2] = {
-            gfxm::vec3(-0.1075f, .0f, .0f),
-            gfxm::vec3(0.1075f, .0f, .0f)
-        };
-        ears[0] = listener_transform * gfxm::vec4(ears[0], 1.0f);
-        ears[1] = listener_transform * gfxm::vec4(ears[1], 1.0f);
-        constexpr float EMITTER_RADIUS = 0.5f;
-        float att = 1.0f / atten_radius;
-        float falloff[2] = {
-            std::min(1.0f / pow((gfxm::length(ears[0] - pos) * att), 2.0f), 1.0f),
-            std::min(1.0f / pow((gfxm::length(ears[1] - pos) * att), 2.0f), 1.0f)
-        };        
-
-        for (int di = 0; di < dst_len; di += dst_channelCount) {
-            int step = di;
-            int si = (int)((src_cur + step / invSampleRatio)) % src_len;
-            float s0 = src[si] * flt_convert * gain;
-            float s1 = src[si + 1] * flt_convert * gain;
-            dst[di] += (s0 + s1) * falloff[0]; // left
-            dst[di + 1] += (s0 + s1) * falloff[1]; // right
-        }
-        // TODO: Handle non-looping
-
-        return (int)(dst_len / invSampleRatio);
-    }
-    size_t mix3d_mono(
-        float* dst, size_t dst_len,
-        short* src, size_t src_len,
-        size_t src_cur, int src_sampleRate,
-        float gain, float atten_radius, bool looping,
-        const gfxm::vec3& pos,
-        const gfxm::mat4& listener_transform
+
+    // Streams arrive already at the device rate
+    template<bool DOWNMIX>
+    bool mixStream(float* dst, float* scratch, size_t dst_frames, size_t row, float gain_l, float gain_r) {
+        AudioStream* stream = voices.stream[row];
+        size_t n = stream->read(scratch, dst_frames);
+        if (stream->channelCount() == 2) {
+            AudioMixSpan<2, DOWNMIX>::getF32(audioMixKernels())(dst, scratch, n, gain_l, gain_r);
+        } else {
+            AudioMixSpan<1, DOWNMIX>::getF32(audioMixKernels())(dst, scratch, n, gain_l, gain_r);
+        }
+        // Running short before the end is an underrun, just a gap
+        return !stream->isFinished();
+    }
+
+    // Mixes dst_frames of src starting at frame cur into dst, splitting
+    // at the wrap point instead of taking a modulo per sample.
+    // Returns the number of source frames consumed
+    template<int SRC_CHANNELS, bool LOOPING, bool DOWNMIX, typename T>
+    size_t mixSpans(
+        float* dst, size_t dst_frames,
+        const T* src, size_t src_frames, size_t cur,
+        float gain_l, float gain_r
     ) {
-        constexpr int dst_channelCount = 2;
-        constexpr float flt_convert = 1.0f / (float)SHORT_MAX;
-        float sampleRatio = src_sampleRate / (float)this->sampleRate;
-        int invSampleRatio = this->sampleRate / src_sampleRate;
-
-        gfxm::vec3 ears[2] = {
-            gfxm::vec3(-0.1075f, .0f, .0f),
-            gfxm::vec3(0.1075f, .0f, .0f)
-        };
-        ears[0] = listener_transform * gfxm::vec4(ears[0], 1.0f);
-        ears[1] = listener_transform * gfxm::vec4(ears[1], 1.0f);
-        constexpr float EMITTER_RADIUS = 0.5f;
-        float att = 1.0f / atten_radius;
-        float falloff[2] = {
-            std::min(1.0f / pow((gfxm::length(ears[0] - pos) * att), 2.0f), 1.0f),
-            std::min(1.0f / pow((gfxm::length(ears[1] - pos) * att), 2.0f), 1.0f)
-        };        
-
-        int samples_till_end = src_len - src_cur;
-        int len_to_sample = looping ? dst_len : std::min((int)dst_len, samples_till_end);
-        for (int di = 0; di < len_to_sample; di += dst_channelCount) {
-            int step = di / dst_channelCount;
-            int si = (int)((src_cur + step / invSampleRatio)) % src_len;
-            float s = src[si] * flt_convert * gain;
-            dst[di] += s * falloff[0]; // left
-            dst[di + 1] += s * falloff[1]; // right
-        }
-
-        return (int)(dst_len / dst_channelCount / invSampleRatio);
+        auto fn = audioMixSpanFn<SRC_CHANNELS, DOWNMIX>(audioMixKernels(), src);
+        size_t done = 0;
+        while (done < dst_frames) {
+            size_t n = std::min(dst_frames - done, src_frames - cur);
+            fn(dst + done * 2, src + cur * SRC_CHANNELS, n, gain_l, gain_r);
+            done += n;
+            cur += n;
+            if (cur == src_frames) {
+                if (!LOOPING) {
+                    break;
+                }
+                cur = 0;
+            }
+        }
+        return done;
     }
 };
 
@@ -0,0 +1,225 @@
+#ifndef AUDIO_PCM_CACHE_HPP
+#define AUDIO_PCM_CACHE_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../log/log.hpp"
+#include "../filesystem/filesystem.hpp"
+#include "audio_buffer.hpp"
+#include "audio_file_mapping.hpp"
+#include "audio_loudness.hpp"
+#include "audio_resampler.hpp"
+
+#define AUDIO_PCM_CACHE_MAGIC 0x4D43504D // 'MPCM'
+#define AUDIO_PCM_CACHE_VERSION 2
+
+#define AUDIO_PCM_CACHE_HAS_LOUDNESS 0x1
+
+// On-disk layout of a cache entry, followed by interleaved s16 samples
+// at data_offset. The header is padded so the samples stay aligned
+struct AudioPcmCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t src_mtime;
+    uint64_t src_size;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint64_t sample_count;
+    uint32_t data_offset;
+    float    integrated_lufs;
+    float    true_peak_db;
+    uint32_t flags;
+    uint8_t  reserved[8];
+};
+static_assert(sizeof(AudioPcmCacheHeader) == 64, "AudioPcmCacheHeader must stay 64 bytes");
+
+// Decoded clips stored as raw PCM next to the executable, so restarts
+// don't decode anything. Entries are named by a hash of the source path
+// (and target rate) and are valid while the source's mtime and size match.
+// Loaded entries are mapped, not read, so the samples are shared with
+// the OS file cache and with other instances
+class AudioPcmCache {
+    std::string dir;
+    int target_sample_rate = 0;
+public:
+    // target_sample_rate other than 0 stores clips pre-resampled to
+    // that rate, usually the mixer rate, so they take the passthrough path
+    void init(const std::string& dir, int target_sample_rate = 0) {
+        this->dir = dir;
+        this->target_sample_rate = target_sample_rate;
+        fsCreateDirRecursive(dir);
+    }
+    bool isEnabled() const { return !dir.empty(); }
+    int  getTargetSampleRate() const { return target_sample_rate; }
+
+    // Null when there's no entry or it's stale. The loudness measured
+    // before the entry was stored goes to loudness, if given
+    std::unique_ptr<AudioBuffer> load(const std::string& src_path, AudioLoudness* loudness = 0) {
+        uint64_t mtime = 0;
+        uint64_t size = 0;
+        if (!isEnabled() || !statSource(src_path, mtime, size)) {
+            return std::unique_ptr<AudioBuffer>();
+        }
+        std::shared_ptr<AudioFileMapping> map(new AudioFileMapping);
+        if (!map->open(entryPath(src_path).c_str()) || map->size() < sizeof(AudioPcmCacheHeader)) {
+            return std::unique_ptr<AudioBuffer>();
+        }
+        AudioPcmCacheHeader hdr;
+        memcpy(&hdr, map->data(), sizeof(hdr));
+        if (hdr.magic != AUDIO_PCM_CACHE_MAGIC
+            || hdr.version != AUDIO_PCM_CACHE_VERSION
+            || hdr.src_mtime != mtime
+            || hdr.src_size != size
+            || hdr.data_offset < sizeof(hdr)
+            || hdr.data_offset % sizeof(short) != 0
+            || hdr.data_offset + hdr.sample_count * sizeof(short) > map->size()
+        ) {
+            return std::unique_ptr<AudioBuffer>();
+        }
+        if (loudness) {
+            *loudness = AudioLoudness();
+            if (hdr.flags & AUDIO_PCM_CACHE_HAS_LOUDNESS) {
+                loudness->valid = true;
+                loudness->integrated_lufs = hdr.integrated_lufs;
+                loudness->true_peak_db = hdr.true_peak_db;
+            }
+        }
+        const short* samples = (const short*)(map->data() + hdr.data_offset);
+        return std::unique_ptr<AudioBuffer>(AudioBuffer::view(
+            samples, (size_t)hdr.sample_count, (int)hdr.sample_rate, (int)hdr.channels, map
+        ));
+    }
+
+    // Writes an entry for a freshly decoded clip. buf is resampled first
+    // if the cache has a target rate, load() then returns the mapped copy
+    bool store(const std::string& src_path, AudioBuffer* buf, const AudioLoudness& loudness = AudioLoudness()) {
+        uint64_t mtime = 0;
+        uint64_t size = 0;
+        if (!isEnabled() || buf->sampleFormat() != AUDIO_SAMPLE_S16 || !statSource(src_path, mtime, size)) {
+            return false;
+        }
+        std::vector<short> resampled;
+        const short* samples = buf->getPtr();
+        size_t sample_count = buf->sampleCount();
+        int sample_rate = buf->sampleRate();
+        if (target_sample_rate && target_sample_rate != sample_rate) {
+            resample(buf, target_sample_rate, resampled);
+            samples = resampled.data();
+            sample_count = resampled.size();
+            sample_rate = target_sample_rate;
+        }
+
+        AudioPcmCacheHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = AUDIO_PCM_CACHE_MAGIC;
+        hdr.version = AUDIO_PCM_CACHE_VERSION;
+        hdr.src_mtime = mtime;
+        hdr.src_size = size;
+        hdr.sample_rate = (uint32_t)sample_rate;
+        hdr.channels = (uint32_t)buf->channelCount();
+        hdr.sample_count = sample_count;
+        hdr.data_offset = sizeof(hdr);
+        if (loudness.valid) {
+            hdr.integrated_lufs = loudness.integrated_lufs;
+            hdr.true_peak_db = loudness.true_peak_db;
+            hdr.flags |= AUDIO_PCM_CACHE_HAS_LOUDNESS;
+        }
+
+        // Written aside and renamed so a reader never maps half a file.
+        // The temp name is unique to this write, two loader threads or
+        // instances storing the same clip don't write into one file
+        std::string path = entryPath(src_path);
+        std::string tmp_path = path + "." + tmpSuffix() + ".tmp";
+        FILE* f = fopen(tmp_path.c_str(), "wb");
+        if (!f) {
+            LOG_WARN("Failed to write pcm cache entry '" << tmp_path << "'");
+            return false;
+        }
+        bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+        if (ok && sample_count) {
+            ok = fwrite(samples, sample_count * sizeof(short), 1, f) == 1;
+        }
+        ok = fclose(f) == 0 && ok;
+        if (ok) {
+            remove(path.c_str());
+            ok = rename(tmp_path.c_str(), path.c_str()) == 0;
+        }
+        if (!ok) {
+            // Most likely another instance has the old entry mapped
+            LOG_DBG("Failed to store pcm cache entry '" << path << "'");
+            remove(tmp_path.c_str());
+        }
+        return ok;
+    }
+private:
+    static std::string tmpSuffix() {
+        static std::atomic<uint32_t> counter{ 0 };
+#ifdef _WIN32
+        unsigned long pid = (unsigned long)_getpid();
+#else
+        unsigned long pid = (unsigned long)getpid();
+#endif
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lx-%x", pid, (unsigned)counter.fetch_add(1));
+        return buf;
+    }
+    static bool statSource(const std::string& path, uint64_t& mtime, uint64_t& size) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+        mtime = (uint64_t)st.st_mtime;
+        size = (uint64_t)st.st_size;
+        return true;
+    }
+    std::string entryPath(const std::string& src_path) const {
+        // FNV-1a over the path and the target rate
+        uint64_t h = 14695981039346656037ull;
+        for (char c : src_path) {
+            h ^= (uint8_t)c;
+            h *= 1099511628211ull;
+        }
+        h ^= (uint64_t)target_sample_rate;
+        h *= 1099511628211ull;
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.pcm", (unsigned long long)h);
+        return dir + "/" + name;
+    }
+    static void resample(AudioBuffer* buf, int dst_rate, std::vector<short>& out) {
+        AudioResampler rs;
+        rs.init(buf->sampleRate(), dst_rate, AUDIO_RESAMPLE_SINC);
+        const int channels = buf->channelCount();
+        const size_t src_frames = buf->sampleCount() / channels;
+        const size_t dst_frames = (size_t)(((uint64_t)src_frames << AUDIO_FRAC_BITS) / rs.step);
+        std::vector<float> tmp(dst_frames * channels);
+        uint64_t pos = 0;
+        size_t n = channels == 2
+            ? audioResample<2, false>(rs, tmp.data(), dst_frames, buf->getPtr(), src_frames, pos)
+            : audioResample<1, false>(rs, tmp.data(), dst_frames, buf->getPtr(), src_frames, pos);
+        out.resize(n * channels);
+        for (size_t i = 0; i < out.size(); ++i) {
+            float s = std::max(-32768.0f, std::min(32767.0f, tmp[i]));
+            out[i] = (short)lrintf(s);
+        }
+    }
+};
+
+inline AudioPcmCache& audioPcmCache() {
+    static AudioPcmCache cache;
+    return cache;
+}
+
+#endif
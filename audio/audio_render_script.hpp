@@ -0,0 +1,391 @@
+#ifndef AUDIO_RENDER_SCRIPT_HPP
+#define AUDIO_RENDER_SCRIPT_HPP
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../log/log.hpp"
+#include "audio_bench.hpp"
+#include "audio_clip.hpp"
+
+// Timed mixer events rendered on a virtual clock, so the same script
+// always produces the same samples whatever the machine is doing.
+// Events land on their exact frame: the mixer renders up to it, the
+// event goes in, rendering continues.
+//
+// Text format, one statement per line, # starts a comment:
+//   tone <clip> <rate> <channels> <seconds> <freq>   synthetic sine clip
+//   clip <clip> <path>                               loaded like the bot does
+//   <t> play <ch> <clip> [gain] [pan]
+//   <t> play3d <ch> <clip> <x> <y> <z> [gain]
+//   <t> stop <ch>
+//   <t> pos <ch> <x> <y> <z>
+//   <t> gain <ch> <gain>
+//   <t> pan <ch> <pan>
+//   <t> loop <ch> <0|1>
+//   <t> rate <ch> <rate>                             playback speed, 2 is an octave up
+//   <t> listener <x> <y> <z>
+//   <t> end                                          render length, default last event + 1s
+// Times are in seconds. Channels are created on first use.
+// Commands only reach the mixer between renders, keep the events
+// sharing one timestamp to a few hundred
+class AudioRenderScript {
+public:
+    bool parse(const std::string& text) {
+        clips.clear();
+        events.clear();
+        end_time = -1.0;
+        std::istringstream lines(text);
+        std::string line;
+        int line_no = 0;
+        while (std::getline(lines, line)) {
+            ++line_no;
+            size_t hash = line.find('#');
+            if (hash != std::string::npos) {
+                line.resize(hash);
+            }
+            std::istringstream in(line);
+            std::string first;
+            if (!(in >> first)) {
+                continue;
+            }
+            if (!parseStatement(first, in)) {
+                LOG_ERR("Render script line " << line_no << ": can't parse '" << line << "'");
+                return false;
+            }
+        }
+        // Same time keeps script order
+        std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+            return a.time < b.time;
+        });
+        return true;
+    }
+    bool load(const std::string& path) {
+        std::vector<uint8_t> bytes;
+        if (!fsSlurpFile(path, bytes)) {
+            LOG_ERR("Failed to read render script '" << path << "'");
+            return false;
+        }
+        return parse(std::string(bytes.begin(), bytes.end()));
+    }
+
+    double length() const {
+        if (end_time >= .0) {
+            return end_time;
+        }
+        return events.empty() ? 1.0 : events.back().time + 1.0;
+    }
+
+    // Interleaved stereo at sampleRate. block_frames is the mixer's
+    // block, output only depends on it through the block grid
+    bool render(int sampleRate, int block_frames, std::vector<float>& out) {
+        std::unique_ptr<AudioMixer> mixer(new AudioMixer);
+        AudioBufferingConfig buffering;
+        buffering.block_frames = block_frames;
+        if (!mixer->init(sampleRate, 16, new AudioBackendManual, buffering)) {
+            return false;
+        }
+        const int nch = mixer->getChannelCount();
+        const uint64_t total = (uint64_t)llround(length() * sampleRate);
+        out.assign((size_t)total * nch, .0f);
+
+        std::map<std::string, Handle<AudioChannel>> channels;
+        uint64_t clock = 0;
+        for (const Event& e : events) {
+            uint64_t at = std::min(total, (uint64_t)llround(e.time * sampleRate));
+            if (at > clock) {
+                mixer->render(out.data() + clock * nch, (size_t)(at - clock));
+                clock = at;
+            }
+            if (e.type == EVT_END) {
+                break;
+            }
+            apply(*mixer, channels, e);
+        }
+        if (total > clock) {
+            mixer->render(out.data() + clock * nch, (size_t)(total - clock));
+        }
+
+        for (auto& it : channels) {
+            mixer->freeChannel(it.second);
+        }
+        mixer->cleanup();
+        return true;
+    }
+private:
+    enum EVT {
+        EVT_PLAY,
+        EVT_PLAY3D,
+        EVT_STOP,
+        EVT_POS,
+        EVT_GAIN,
+        EVT_PAN,
+        EVT_LOOP,
+        EVT_RATE,
+        EVT_LISTENER,
+        EVT_END
+    };
+    struct Event {
+        double      time = .0;
+        EVT         type = EVT_END;
+        std::string channel;
+        std::string clip;
+        gfxm::vec3  pos;
+        float       value = 1.0f;  // gain, or pan, or loop flag
+        float       pan = .0f;
+    };
+
+    std::map<std::string, std::shared_ptr<AudioBuffer>> clips;
+    std::vector<Event> events;
+    double end_time = -1.0;
+
+    bool parseStatement(const std::string& first, std::istringstream& in) {
+        if (first == "tone") {
+            std::string name;
+            int rate = 0;
+            int channels = 0;
+            float seconds = .0f;
+            float freq = .0f;
+            if (!(in >> name >> rate >> channels >> seconds >> freq) || rate <= 0 || (channels != 1 && channels != 2) || seconds <= .0f) {
+                return false;
+            }
+            clips[name] = std::shared_ptr<AudioBuffer>(audioBenchTone(rate, channels, seconds, freq).release());
+            return true;
+        }
+        if (first == "clip") {
+            std::string name;
+            std::string path;
+            if (!(in >> name >> path)) {
+                return false;
+            }
+            std::shared_ptr<AudioClip> clip(new AudioClip);
+            if (!clip->load(path)) {
+                return false;
+            }
+            clips[name] = audioClipBuffer(clip);
+            return true;
+        }
+
+        Event e;
+        std::string type;
+        char* end = 0;
+        e.time = strtod(first.c_str(), &end);
+        if (*end != '\0' || e.time < .0 || !(in >> type)) {
+            return false;
+        }
+        if (type == "end") {
+            e.type = EVT_END;
+            end_time = e.time;
+        } else if (type == "listener") {
+            e.type = EVT_LISTENER;
+            if (!(in >> e.pos.x >> e.pos.y >> e.pos.z)) {
+                return false;
+            }
+        } else {
+            if (!(in >> e.channel)) {
+                return false;
+            }
+            if (type == "play") {
+                e.type = EVT_PLAY;
+                if (!(in >> e.clip)) {
+                    return false;
+                }
+                readOptional(in, e.value);
+                readOptional(in, e.pan);
+            } else if (type == "play3d") {
+                e.type = EVT_PLAY3D;
+                if (!(in >> e.clip >> e.pos.x >> e.pos.y >> e.pos.z)) {
+                    return false;
+                }
+                readOptional(in, e.value);
+            } else if (type == "stop") {
+                e.type = EVT_STOP;
+            } else if (type == "pos") {
+                e.type = EVT_POS;
+                if (!(in >> e.pos.x >> e.pos.y >> e.pos.z)) {
+                    return false;
+                }
+            } else if (type == "gain" || type == "pan" || type == "loop" || type == "rate") {
+                e.type = type == "gain" ? EVT_GAIN : (type == "pan" ? EVT_PAN : (type == "loop" ? EVT_LOOP : EVT_RATE));
+                if (!(in >> e.value)) {
+                    return false;
+                }
+            } else {
+                return false;
+            }
+            if ((e.type == EVT_PLAY || e.type == EVT_PLAY3D) && !clips.count(e.clip)) {
+                LOG_ERR("Render script: unknown clip '" << e.clip << "'");
+                return false;
+            }
+        }
+        events.push_back(e);
+        return true;
+    }
+
+    // A failed >> zeroes its target, keep the default instead
+    static void readOptional(std::istringstream& in, float& v) {
+        float x;
+        if (in >> x) {
+            v = x;
+        }
+    }
+
+    void apply(AudioMixer& mixer, std::map<std::string, Handle<AudioChannel>>& channels, const Event& e) {
+        if (e.type == EVT_LISTENER) {
+            mixer.setListenerTransform(gfxm::translate(gfxm::mat4(1.0f), e.pos));
+            return;
+        }
+        auto it = channels.find(e.channel);
+        if (it == channels.end()) {
+            it = channels.insert(std::make_pair(e.channel, mixer.createChannel())).first;
+        }
+        Handle<AudioChannel> ch = it->second;
+        switch (e.type) {
+        case EVT_PLAY:
+        case EVT_PLAY3D:
+            mixer.setBuffer(ch, clips[e.clip].get());
+            mixer.setGain(ch, e.value);
+            if (e.type == EVT_PLAY) {
+                mixer.setPanning(ch, e.pan);
+                mixer.play(ch);
+            } else {
+                mixer.setPosition(ch, e.pos);
+                mixer.play3d(ch);
+            }
+            break;
+        case EVT_STOP:
+            mixer.stop(ch);
+            break;
+        case EVT_POS:
+            mixer.setPosition(ch, e.pos);
+            break;
+        case EVT_GAIN:
+            mixer.setGain(ch, e.value);
+            break;
+        case EVT_PAN:
+            mixer.setPanning(ch, e.value);
+            break;
+        case EVT_LOOP:
+            mixer.setLooping(ch, e.value != .0f);
+            break;
+        case EVT_RATE:
+            mixer.setRate(ch, e.value);
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+// 32 bit float wav, renders are compared at full precision
+inline bool audioWriteWavF32(const std::string& path, const float* samples, size_t frames, int sampleRate, int channels) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        LOG_ERR("Failed to open '" << path << "' for writing");
+        return false;
+    }
+    const uint32_t data_bytes = (uint32_t)(frames * channels * sizeof(float));
+    const uint32_t riff_sz = 36 + data_bytes;
+    const uint32_t fmt_sz = 16;
+    const uint16_t fmt_tag = 3; // IEEE float
+    const uint16_t nch = (uint16_t)channels;
+    const uint32_t rate = (uint32_t)sampleRate;
+    const uint32_t byte_rate = rate * channels * sizeof(float);
+    const uint16_t block_align = (uint16_t)(channels * sizeof(float));
+    const uint16_t bits = 32;
+    fwrite("RIFF", 4, 1, f);
+    fwrite(&riff_sz, 4, 1, f);
+    fwrite("WAVEfmt ", 8, 1, f);
+    fwrite(&fmt_sz, 4, 1, f);
+    fwrite(&fmt_tag, 2, 1, f);
+    fwrite(&nch, 2, 1, f);
+    fwrite(&rate, 4, 1, f);
+    fwrite(&byte_rate, 4, 1, f);
+    fwrite(&block_align, 2, 1, f);
+    fwrite(&bits, 2, 1, f);
+    fwrite("data", 4, 1, f);
+    fwrite(&data_bytes, 4, 1, f);
+    bool ok = !data_bytes || fwrite(samples, data_bytes, 1, f) == 1;
+    return fclose(f) == 0 && ok;
+}
+
+// 16 bit PCM or 32 bit float wav as floats
+inline bool audioReadWav(const std::string& path, std::vector<float>& samples, int& sampleRate, int& channels) {
+    std::vector<uint8_t> bytes;
+    if (!fsSlurpFile(path, bytes) || bytes.size() < 12
+        || memcmp(bytes.data(), "RIFF", 4) != 0 || memcmp(bytes.data() + 8, "WAVE", 4) != 0
+    ) {
+        LOG_ERR("'" << path << "' is not a readable wav file");
+        return false;
+    }
+    auto u16 = [&](size_t at) { return (uint32_t)(bytes[at] | (bytes[at + 1] << 8)); };
+    auto u32 = [&](size_t at) { return u16(at) | (u16(at + 2) << 16); };
+    uint32_t format = 0;
+    uint32_t bits = 0;
+    size_t at = 12;
+    while (at + 8 <= bytes.size()) {
+        size_t sz = u32(at + 4);
+        size_t body = at + 8;
+        if (memcmp(&bytes[at], "fmt ", 4) == 0 && sz >= 16 && body + 16 <= bytes.size()) {
+            format = u16(body);
+            channels = (int)u16(body + 2);
+            sampleRate = (int)u32(body + 4);
+            bits = u16(body + 14);
+        } else if (memcmp(&bytes[at], "data", 4) == 0) {
+            sz = std::min(sz, bytes.size() - body);
+            if (format == 3 && bits == 32) {
+                samples.resize(sz / sizeof(float));
+                memcpy(samples.data(), &bytes[body], samples.size() * sizeof(float));
+                return true;
+            }
+            if (format == 1 && bits == 16) {
+                samples.resize(sz / sizeof(short));
+                for (size_t i = 0; i < samples.size(); ++i) {
+                    short s;
+                    memcpy(&s, &bytes[body + i * sizeof(short)], sizeof(short));
+                    samples[i] = s / 32767.0f;
+                }
+                return true;
+            }
+            LOG_ERR("'" << path << "' is neither 16 bit PCM nor 32 bit float");
+            return false;
+        }
+        at = body + sz + (sz & 1);
+    }
+    LOG_ERR("'" << path << "' has no data chunk");
+    return false;
+}
+
+struct AudioRenderDiff {
+    bool   same_length = true;
+    double max_abs = .0;
+    double rms = .0;
+    long long first_over = -1;  // first frame off by more than the tolerance, -1 if none
+};
+
+inline AudioRenderDiff audioCompareRender(const std::vector<float>& a, const std::vector<float>& b, int channels, double tolerance) {
+    AudioRenderDiff d;
+    d.same_length = a.size() == b.size();
+    const size_t n = std::min(a.size(), b.size());
+    double sum = .0;
+    for (size_t i = 0; i < n; ++i) {
+        double e = fabs((double)a[i] - b[i]);
+        sum += e * e;
+        d.max_abs = std::max(d.max_abs, e);
+        if (e > tolerance && d.first_over < 0) {
+            d.first_over = (long long)(i / channels);
+        }
+    }
+    d.rms = n ? sqrt(sum / n) : .0;
+    return d;
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef AUDIO_RESAMPLER_HPP
+#define AUDIO_RESAMPLER_HPP
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+
+enum AUDIO_RESAMPLE_QUALITY {
+    AUDIO_RESAMPLE_LINEAR,
+    AUDIO_RESAMPLE_SINC
+};
+
+// Fixed point 32.32 source positions, enough for ~24 hours at 48k
+constexpr int      AUDIO_FRAC_BITS = 32;
+constexpr uint64_t AUDIO_FRAC_ONE = 1ull << AUDIO_FRAC_BITS;
+constexpr uint64_t AUDIO_FRAC_MASK = AUDIO_FRAC_ONE - 1;
+
+// Kaiser windowed sinc, one row of taps per fractional phase.
+// Output frame at source position i + x is
+//   sum(coefs[phase(x)][k] * src[i + k - (TAPS / 2 - 1)])
+struct AudioSincTable {
+    static constexpr int TAPS = 16;
+    static constexpr int PHASE_BITS = 8;
+    static constexpr int PHASES = 1 << PHASE_BITS;
+
+    float cutoff;
+    alignas(16) float coefs[PHASES][TAPS];
+
+    void build(float cutoff) {
+        this->cutoff = cutoff;
+        const double pi = 3.14159265358979323846;
+        const double beta = 8.0;
+        const double half = TAPS / 2;
+        for (int p = 0; p < PHASES; ++p) {
+            double x = p / (double)PHASES;
+            double sum = .0;
+            for (int k = 0; k < TAPS; ++k) {
+                double t = (k - (TAPS / 2 - 1)) - x;
+                double s = t == .0 ? 1.0 : sin(pi * cutoff * t) / (pi * cutoff * t);
+                double w = t / half;
+                w = w * w >= 1.0 ? .0 : besselI0(beta * sqrt(1.0 - w * w)) / besselI0(beta);
+                double h = cutoff * s * w;
+                coefs[p][k] = (float)h;
+                sum += h;
+            }
+            // Unity gain at DC for every phase
+            for (int k = 0; k < TAPS; ++k) {
+                coefs[p][k] = (float)(coefs[p][k] / sum);
+            }
+        }
+    }
+private:
+    static double besselI0(double x) {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int k = 1; k < 32; ++k) {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+            if (term < sum * 1e-12) {
+                break;
+            }
+        }
+        return sum;
+    }
+};
+
+// Tables are shared between voices, one per distinct cutoff.
+// rate is the playback speed on top of the rate conversion
+inline const AudioSincTable* audioGetSincTable(int srcSampleRate, int dstSampleRate, float rate = 1.0f) {
+    static std::mutex sync;
+    static std::map<int, std::unique_ptr<AudioSincTable>> tables;
+
+    // Keep some headroom below nyquist, and below the destination
+    // nyquist when downsampling
+    const float src_rate = srcSampleRate * rate;
+    float ratio = dstSampleRate < src_rate ? dstSampleRate / src_rate : 1.0f;
+    if (rate != 1.0f) {
+        // Random pitch would make a table per voice otherwise
+        ratio = floorf(ratio * 128.0f) / 128.0f;
+    }
+    float cutoff = ratio * .92f;
+    int key = (int)(cutoff * 10000.0f);
+
+    std::lock_guard<std::mutex> lock(sync);
+    auto it = tables.find(key);
+    if (it != tables.end()) {
+        return it->second.get();
+    }
+    AudioSincTable* table = new AudioSincTable;
+    table->build(cutoff);
+    tables.insert(std::make_pair(key, std::unique_ptr<AudioSincTable>(table)));
+    return table;
+}
+
+// Per-voice rate conversion parameters. The position itself lives
+// with the voice so a voice can switch buffers or restart freely
+struct AudioResampler {
+    uint64_t step = AUDIO_FRAC_ONE; // source frames per output frame
+    const AudioSincTable* sinc = 0; // 0 - linear
+
+    // rate other than 1 plays faster (higher) or slower (lower)
+    void init(int srcSampleRate, int dstSampleRate, AUDIO_RESAMPLE_QUALITY quality, float rate = 1.0f) {
+        if (rate == 1.0f) {
+            step = ((uint64_t)srcSampleRate << AUDIO_FRAC_BITS) / (uint64_t)dstSampleRate;
+        } else {
+            step = (uint64_t)((double)srcSampleRate * rate / dstSampleRate * (double)AUDIO_FRAC_ONE + .5);
+            step = std::max<uint64_t>(step, 1);
+        }
+        sinc = 0;
+        if (quality == AUDIO_RESAMPLE_SINC && step != AUDIO_FRAC_ONE) {
+            sinc = audioGetSincTable(srcSampleRate, dstSampleRate, rate);
+        }
+    }
+    bool isPassthrough(uint64_t pos) const {
+        return step == AUDIO_FRAC_ONE && (pos & AUDIO_FRAC_MASK) == 0;
+    }
+    // Output frames it takes to play src_frames from the start
+    uint64_t outputFrames(uint64_t src_frames) const {
+        return ((src_frames << AUDIO_FRAC_BITS) + step - 1) / step;
+    }
+};
+
+// Reads a source frame outside of the fast path. Out of range frames
+// wrap when looping and are silent otherwise
+template<int SRC_CHANNELS, bool LOOPING, typename T>
+inline float audioResampleFetch(const T* src, int64_t src_frames, int64_t i, int ch) {
+    if (i < 0 || i >= src_frames) {
+        if (!LOOPING) {
+            return .0f;
+        }
+        i %= src_frames;
+        if (i < 0) {
+            i += src_frames;
+        }
+    }
+    return (float)src[i * SRC_CHANNELS + ch];
+}
+
+// Converts s16 or float source frames at a fractional step into float
+// frames (still SRC_CHANNELS wide, in the source's scale).
+// pos is a 32.32 source frame position, advanced in place.
+// Returns the number of frames written, less than dst_frames only
+// when a non-looping source runs out
+template<int SRC_CHANNELS, bool LOOPING, typename T>
+inline size_t audioResample(
+    const AudioResampler& rs,
+    float* dst, size_t dst_frames,
+    const T* src, size_t src_frames,
+    uint64_t& pos
+) {
+    const uint64_t end = (uint64_t)src_frames << AUDIO_FRAC_BITS;
+    const int64_t frames = (int64_t)src_frames;
+    size_t di = 0;
+    if (!rs.sinc) {
+        for (; di < dst_frames; ++di) {
+            if (pos >= end) {
+                if (!LOOPING) {
+                    break;
+                }
+                pos %= end;
+            }
+            int64_t i = (int64_t)(pos >> AUDIO_FRAC_BITS);
+            float t = (pos & AUDIO_FRAC_MASK) * (1.0f / (float)AUDIO_FRAC_ONE);
+            for (int ch = 0; ch < SRC_CHANNELS; ++ch) {
+                float a = (float)src[i * SRC_CHANNELS + ch];
+                float b = audioResampleFetch<SRC_CHANNELS, LOOPING>(src, frames, i + 1, ch);
+                dst[di * SRC_CHANNELS + ch] = a + (b - a) * t;
+            }
+            pos += rs.step;
+        }
+        return di;
+    }
+
+    constexpr int TAPS = AudioSincTable::TAPS;
+    constexpr int HALF = TAPS / 2 - 1;
+    for (; di < dst_frames; ++di) {
+        if (pos >= end) {
+            if (!LOOPING) {
+                break;
+            }
+            pos %= end;
+        }
+        int64_t i = (int64_t)(pos >> AUDIO_FRAC_BITS);
+        int phase = (int)((pos & AUDIO_FRAC_MASK) >> (AUDIO_FRAC_BITS - AudioSincTable::PHASE_BITS));
+        const float* h = rs.sinc->coefs[phase];
+        float acc[SRC_CHANNELS] = { .0f };
+        int64_t first = i - HALF;
+        if (first >= 0 && first + TAPS <= frames) {
+            const T* s = src + first * SRC_CHANNELS;
+            for (int k = 0; k < TAPS; ++k) {
+                for (int ch = 0; ch < SRC_CHANNELS; ++ch) {
+                    acc[ch] += h[k] * (float)s[k * SRC_CHANNELS + ch];
+                }
+            }
+        } else {
+            for (int k = 0; k < TAPS; ++k) {
+                for (int ch = 0; ch < SRC_CHANNELS; ++ch) {
+                    acc[ch] += h[k] * audioResampleFetch<SRC_CHANNELS, LOOPING>(src, frames, first + k, ch);
+                }
+            }
+        }
+        for (int ch = 0; ch < SRC_CHANNELS; ++ch) {
+            dst[di * SRC_CHANNELS + ch] = acc[ch];
+        }
+        pos += rs.step;
+    }
+    return di;
+}
+
+#endif
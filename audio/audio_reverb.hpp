@@ -0,0 +1,315 @@
+#ifndef AUDIO_REVERB_HPP
+#define AUDIO_REVERB_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "audio_buffer.hpp"
+#include "audio_resampler.hpp"
+#include "audio_simd.hpp"
+
+struct AudioReverbConfig {
+    float return_db = .0f;          // wet level into the master bus
+    float max_seconds = 3.0f;       // longer impulse responses are cut short
+};
+
+// In place radix 2 FFT on split complex arrays, size a power of two.
+// The inverse is not scaled, results come out size() times larger
+class AudioFft {
+    size_t n = 0;
+    std::vector<uint32_t> rev;
+    std::vector<float> cos_t;
+    std::vector<float> sin_t;
+public:
+    void init(size_t size) {
+        n = size;
+        int bits = 0;
+        while (((size_t)1 << bits) < n) {
+            ++bits;
+        }
+        rev.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t r = 0;
+            for (int b = 0; b < bits; ++b) {
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            }
+            rev[i] = r;
+        }
+        cos_t.resize(n / 2);
+        sin_t.resize(n / 2);
+        for (size_t i = 0; i < n / 2; ++i) {
+            cos_t[i] = (float)cos(6.283185307179586 * i / n);
+            sin_t[i] = (float)sin(6.283185307179586 * i / n);
+        }
+    }
+    size_t size() const { return n; }
+
+    void run(float* re, float* im, bool inverse) const {
+        for (size_t i = 0; i < n; ++i) {
+            if (rev[i] > i) {
+                std::swap(re[i], re[rev[i]]);
+                std::swap(im[i], im[rev[i]]);
+            }
+        }
+        const float sign = inverse ? 1.0f : -1.0f;
+        for (size_t len = 2; len <= n; len <<= 1) {
+            const size_t half = len / 2;
+            const size_t tstep = n / len;
+            for (size_t i = 0; i < n; i += len) {
+                for (size_t j = 0; j < half; ++j) {
+                    const float wr = cos_t[j * tstep];
+                    const float wi = sign * sin_t[j * tstep];
+                    const size_t a = i + j;
+                    const size_t b = a + half;
+                    const float tr = re[b] * wr - im[b] * wi;
+                    const float ti = re[b] * wi + im[b] * wr;
+                    re[b] = re[a] - tr;
+                    im[b] = im[a] - ti;
+                    re[a] += tr;
+                    im[a] += ti;
+                }
+            }
+        }
+    }
+};
+
+// Convolution with a long impulse response, uniformly partitioned
+// overlap-save. The response is cut into partitions of block frames,
+// each kept as a spectrum of 2 * block bins; every block of input is
+// transformed once and lands in a ring of past input spectra, and the
+// output block is the sum over partitions of (input p blocks ago) *
+// (partition p), one inverse transform. Cost per block is fixed by the
+// response length alone, whatever is fed in.
+//
+// Stereo input rides in one complex transform, left as the real and
+// right as the imaginary part. A mono response filters both the same
+// way. A stereo one is split into mid (hl + hr) / 2 and side
+// (hl - hr) / 2, and the side is convolved with the conjugate of the
+// input (l - ir): it adds to the left and takes away from the right,
+// so the left comes out filtered by hl and the right by hr. Twice the work.
+//
+// Input is collected a block at a time, the output lags by block frames
+class AudioConvolver {
+    size_t block = 0;
+    size_t partitions = 0;
+    bool stereo_ir = false;
+    AudioFft fft;
+
+    // Partition spectra, 2 * block bins each, back to back
+    std::vector<float> mid_re, mid_im;
+    std::vector<float> side_re, side_im;
+    // Ring of input spectra, the newest at head
+    std::vector<float> in_re, in_im;
+    std::vector<float> mirror_re, mirror_im;
+    size_t head = 0;
+
+    std::vector<float> prev;        // last block of input, interleaved stereo
+    std::vector<float> fifo_in;
+    std::vector<float> fifo_out;
+    size_t fill = 0;
+    std::vector<float> work_re, work_im;
+    std::vector<float> acc_re, acc_im;
+public:
+    // ir is interleaved float with 1 or 2 channels, at the rate of the
+    // signal it will be fed. block is rounded up to a power of two
+    void init(const float* ir, size_t frames, int channels, size_t block_frames) {
+        block = 1;
+        while (block < block_frames) {
+            block <<= 1;
+        }
+        const size_t n = block * 2;
+        fft.init(n);
+        partitions = std::max<size_t>(1, (frames + block - 1) / block);
+        stereo_ir = channels == 2;
+
+        mid_re.assign(partitions * n, .0f);
+        mid_im.assign(partitions * n, .0f);
+        side_re.assign(stereo_ir ? partitions * n : 0, .0f);
+        side_im.assign(stereo_ir ? partitions * n : 0, .0f);
+        for (size_t p = 0; p < partitions; ++p) {
+            float* mr = &mid_re[p * n];
+            float* mi = &mid_im[p * n];
+            for (size_t i = 0; i < block && p * block + i < frames; ++i) {
+                const float* f = ir + (p * block + i) * channels;
+                mr[i] = stereo_ir ? (f[0] + f[1]) * .5f : f[0];
+                if (stereo_ir) {
+                    // Real side into the imaginary half of the same
+                    // transform, pulled apart below
+                    mi[i] = (f[0] - f[1]) * .5f;
+                }
+            }
+            fft.run(mr, mi, false);
+            if (stereo_ir) {
+                // Spectra of two real signals packed as a + ib:
+                // A[k] = (Z[k] + conj(Z[n-k])) / 2, B[k] = (Z[k] - conj(Z[n-k])) / 2i
+                float* sr = &side_re[p * n];
+                float* si = &side_im[p * n];
+                std::vector<float> zr(mr, mr + n), zi(mi, mi + n);
+                for (size_t k = 0; k < n; ++k) {
+                    const size_t m = (n - k) & (n - 1);
+                    mr[k] = (zr[k] + zr[m]) * .5f;
+                    mi[k] = (zi[k] - zi[m]) * .5f;
+                    sr[k] = (zi[k] + zi[m]) * .5f;
+                    si[k] = (zr[m] - zr[k]) * .5f;
+                }
+            }
+        }
+
+        in_re.assign(partitions * n, .0f);
+        in_im.assign(partitions * n, .0f);
+        mirror_re.assign(stereo_ir ? partitions * n : 0, .0f);
+        mirror_im.assign(stereo_ir ? partitions * n : 0, .0f);
+        head = 0;
+        prev.assign(block * 2, .0f);
+        fifo_in.assign(block * 2, .0f);
+        fifo_out.assign(block * 2, .0f);
+        fill = 0;
+        work_re.assign(n, .0f);
+        work_im.assign(n, .0f);
+        acc_re.assign(n, .0f);
+        acc_im.assign(n, .0f);
+    }
+
+    size_t blockSize() const { return block; }
+    size_t partitionCount() const { return partitions; }
+    size_t latency() const { return block; }
+
+    // Adds the wet signal times gain to out, both interleaved stereo
+    void process(const float* in, float* out, size_t frames, float gain) {
+        while (frames) {
+            const size_t n = std::min(frames, block - fill);
+            memcpy(&fifo_in[fill * 2], in, n * 2 * sizeof(float));
+            if (gain == 1.0f) {
+                audioAccumulate(out, &fifo_out[fill * 2], n * 2);
+            } else {
+                audioMixKernels().mix_stereo_f32(out, &fifo_out[fill * 2], n, gain, gain);
+            }
+            in += n * 2;
+            out += n * 2;
+            frames -= n;
+            fill += n;
+            if (fill == block) {
+                runBlock();
+                fill = 0;
+            }
+        }
+    }
+private:
+    void runBlock() {
+        const size_t n = block * 2;
+        // Previous block then this one, the first half of the result
+        // wraps around and is thrown away
+        for (size_t i = 0; i < block; ++i) {
+            work_re[i] = prev[i * 2];
+            work_im[i] = prev[i * 2 + 1];
+            work_re[block + i] = fifo_in[i * 2];
+            work_im[block + i] = fifo_in[i * 2 + 1];
+        }
+        prev.swap(fifo_in);
+        fft.run(work_re.data(), work_im.data(), false);
+
+        head = head ? head - 1 : partitions - 1;
+        memcpy(&in_re[head * n], work_re.data(), n * sizeof(float));
+        memcpy(&in_im[head * n], work_im.data(), n * sizeof(float));
+        if (stereo_ir) {
+            // Spectrum of conj(x): conj(X[n-k])
+            float* mr = &mirror_re[head * n];
+            float* mi = &mirror_im[head * n];
+            for (size_t k = 0; k < n; ++k) {
+                const size_t m = (n - k) & (n - 1);
+                mr[k] = work_re[m];
+                mi[k] = -work_im[m];
+            }
+        }
+
+        memset(acc_re.data(), 0, n * sizeof(float));
+        memset(acc_im.data(), 0, n * sizeof(float));
+        for (size_t p = 0; p < partitions; ++p) {
+            const size_t slot = (head + p) % partitions;
+            audioComplexMac(acc_re.data(), acc_im.data(),
+                &in_re[slot * n], &in_im[slot * n], &mid_re[p * n], &mid_im[p * n], n);
+            if (stereo_ir) {
+                audioComplexMac(acc_re.data(), acc_im.data(),
+                    &mirror_re[slot * n], &mirror_im[slot * n], &side_re[p * n], &side_im[p * n], n);
+            }
+        }
+        fft.run(acc_re.data(), acc_im.data(), true);
+        const float scale = 1.0f / n;
+        for (size_t i = 0; i < block; ++i) {
+            fifo_out[i * 2] = acc_re[block + i] * scale;
+            fifo_out[i * 2 + 1] = acc_im[block + i] * scale;
+        }
+    }
+};
+
+// Impulse response from a clip: float at sampleRate, at most
+// max_seconds long (the cut is faded out), scaled to unit energy per
+// channel so the wet signal comes out about as loud as the dry one
+inline std::vector<float> audioReverbImpulse(AudioBuffer* buf, int sampleRate, float max_seconds, int& channels) {
+    channels = std::max(1, std::min(2, buf->channelCount()));
+    const int src_channels = buf->channelCount();
+    const size_t src_frames = buf->sampleCount() / std::max(1, src_channels);
+
+    // The first two source channels as float, any past those are
+    // dropped. Surround layouts don't fold down to stereo one way,
+    // mix such responses down before using them
+    std::vector<float> src(src_frames * channels);
+    const short* s16 = buf->getPtr();
+    const float* f32 = buf->getPtrF32();
+    if (src_channels == channels && s16) {
+        audioMixKernels().convert(src.data(), s16, src.size(), 1.0f / 32768.0f);
+    } else if (src_channels == channels) {
+        memcpy(src.data(), f32, src.size() * sizeof(float));
+    } else {
+        for (size_t i = 0; i < src_frames; ++i) {
+            for (int c = 0; c < channels; ++c) {
+                const size_t at = i * src_channels + c;
+                src[i * channels + c] = s16 ? s16[at] * (1.0f / 32768.0f) : f32[at];
+            }
+        }
+    }
+
+    std::vector<float> ir;
+    if (buf->sampleRate() == sampleRate) {
+        ir.swap(src);
+    } else {
+        AudioResampler rs;
+        rs.init(buf->sampleRate(), sampleRate, AUDIO_RESAMPLE_SINC);
+        ir.resize((size_t)rs.outputFrames(src_frames) * channels);
+        uint64_t pos = 0;
+        size_t done = channels == 2
+            ? audioResample<2, false>(rs, ir.data(), ir.size() / 2, src.data(), src_frames, pos)
+            : audioResample<1, false>(rs, ir.data(), ir.size(), src.data(), src_frames, pos);
+        ir.resize(done * channels);
+    }
+
+    const size_t max_frames = (size_t)(max_seconds * sampleRate);
+    if (ir.size() / channels > max_frames) {
+        ir.resize(max_frames * channels);
+        const size_t fade = max_frames / 10;
+        for (size_t i = 0; i < fade; ++i) {
+            const float g = (float)i / fade;
+            for (int c = 0; c < channels; ++c) {
+                ir[(max_frames - 1 - i) * channels + c] *= g;
+            }
+        }
+    }
+
+    double energy = .0;
+    for (float x : ir) {
+        energy += (double)x * x;
+    }
+    if (energy > .0) {
+        const float g = (float)(1.0 / sqrt(energy / channels));
+        for (float& x : ir) {
+            x *= g;
+        }
+    }
+    return ir;
+}
+
+#endif
@@ -0,0 +1,538 @@
+#ifndef AUDIO_SIMD_HPP
+#define AUDIO_SIMD_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AUDIO_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#define AUDIO_TARGET_AVX2
+#else
+#define AUDIO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(AUDIO_SIMD_X86)
+#define AUDIO_PREFETCH(PTR) _mm_prefetch((const char*)(PTR), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define AUDIO_PREFETCH(PTR) __builtin_prefetch(PTR)
+#else
+#define AUDIO_PREFETCH(PTR)
+#endif
+
+// All kernels take s16 source frames and accumulate into interleaved
+// stereo float. gain_l/gain_r already include the s16 -> float scale
+// (see audioMixGain()), so the inner loops are a single multiply-add
+typedef void (*audio_mix_fn_t)(float* dst, const short* src, size_t frames, float gain_l, float gain_r);
+typedef void (*audio_convert_fn_t)(float* dst, const short* src, size_t count, float gain);
+// Same, but for sources already converted to float (resampler output)
+typedef void (*audio_mix_f32_fn_t)(float* dst, const float* src, size_t frames, float gain_l, float gain_r);
+
+// Noise generator for audioToS16Dither, one xorshift32 per lane.
+// Sample i always draws from lane i % 4, so every kernel produces
+// the same output
+struct AudioDitherState {
+    alignas(16) uint32_t lanes[4] = { 0x9E3779B9u, 0x7F4A7C15u, 0x2545F491u, 0xB5297A4Du };
+};
+// f32 [-1, 1] -> s16 with TPDF dither (two uniform 1 LSB noises
+// summed) so quiet passages and fades don't turn into distortion
+typedef void (*audio_dither_fn_t)(short* dst, const float* src, size_t count, AudioDitherState& state);
+
+struct AudioMixKernels {
+    const char*        name;
+    // mono source, same sample to both sides
+    audio_mix_fn_t     mix_mono;
+    // stereo source, L to left, R to right
+    audio_mix_fn_t     mix_stereo;
+    // stereo source summed to mono first, used for 3d
+    audio_mix_fn_t     mix_stereo_downmix;
+    // plain s16 -> f32
+    audio_convert_fn_t convert;
+
+    audio_mix_f32_fn_t mix_mono_f32;
+    audio_mix_f32_fn_t mix_stereo_f32;
+    audio_mix_f32_fn_t mix_stereo_downmix_f32;
+
+    // output stage, mixed float to device s16
+    audio_dither_fn_t  to_s16_dither;
+};
+
+inline float audioMixGain(float gain) {
+    return gain * (1.0f / 32767.0f);
+}
+
+// Left/right gains for a [-1, 1] pan, same law the mixer always used
+inline void audioPanGains(float gain, float pan, float& gain_l, float& gain_r) {
+    float l = -1.0f + pan;
+    float r = 1.0f + pan;
+    l = l < .0f ? -l : l;
+    r = r < .0f ? -r : r;
+    gain_l = gain * (l < 1.0f ? l : 1.0f);
+    gain_r = gain * (r < 1.0f ? r : 1.0f);
+}
+
+inline void audioMixMono_scalar(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    for (size_t i = 0; i < frames; ++i) {
+        float s = (float)src[i];
+        dst[i * 2]     += s * gain_l;
+        dst[i * 2 + 1] += s * gain_r;
+    }
+}
+inline void audioMixStereo_scalar(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    for (size_t i = 0; i < frames; ++i) {
+        dst[i * 2]     += (float)src[i * 2] * gain_l;
+        dst[i * 2 + 1] += (float)src[i * 2 + 1] * gain_r;
+    }
+}
+inline void audioMixStereoDownmix_scalar(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    for (size_t i = 0; i < frames; ++i) {
+        float s = (float)src[i * 2] + (float)src[i * 2 + 1];
+        dst[i * 2]     += s * gain_l;
+        dst[i * 2 + 1] += s * gain_r;
+    }
+}
+inline void audioConvert_scalar(float* dst, const short* src, size_t count, float gain) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = (float)src[i] * gain;
+    }
+}
+
+inline void audioMixMonoF32_scalar(float* dst, const float* src, size_t frames, float gain_l, float gain_r) {
+    for (size_t i = 0; i < frames; ++i) {
+        dst[i * 2]     += src[i] * gain_l;
+        dst[i * 2 + 1] += src[i] * gain_r;
+    }
+}
+inline void audioMixStereoF32_scalar(float* dst, const float* src, size_t frames, float gain_l, float gain_r) {
+    for (size_t i = 0; i < frames; ++i) {
+        dst[i * 2]     += src[i * 2] * gain_l;
+        dst[i * 2 + 1] += src[i * 2 + 1] * gain_r;
+    }
+}
+inline void audioMixStereoDownmixF32_scalar(float* dst, const float* src, size_t frames, float gain_l, float gain_r) {
+    for (size_t i = 0; i < frames; ++i) {
+        float s = src[i * 2] + src[i * 2 + 1];
+        dst[i * 2]     += s * gain_l;
+        dst[i * 2 + 1] += s * gain_r;
+    }
+}
+
+inline uint32_t audioDitherNext(uint32_t& x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+inline void audioToS16Dither_scalar(short* dst, const float* src, size_t count, AudioDitherState& state) {
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t& lane = state.lanes[i & 3];
+        float a = (float)(int32_t)audioDitherNext(lane);
+        float b = (float)(int32_t)audioDitherNext(lane);
+        float s = src[i] * 32767.0f + (a + b) * (1.0f / 4294967296.0f);
+        s = s > 32767.0f ? 32767.0f : (s < -32768.0f ? -32768.0f : s);
+        dst[i] = (short)lrintf(s);
+    }
+}
+
+// Largest absolute sample
+inline float audioPeak(const float* src, size_t count) {
+    size_t i = 0;
+    float m = .0f;
+#ifdef AUDIO_SIMD_X86
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 v = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        v = _mm_max_ps(v, _mm_and_ps(_mm_loadu_ps(src + i), abs_mask));
+    }
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_max_ss(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+    m = _mm_cvtss_f32(v);
+#endif
+    for (; i < count; ++i) {
+        float a = src[i] < .0f ? -src[i] : src[i];
+        m = a > m ? a : m;
+    }
+    return m;
+}
+
+// Interleaved stereo dst += src * gain, the gain going linearly
+// from gain_from to gain_to over the frames. For fader moves
+inline void audioMixStereoRampF32(float* dst, const float* src, size_t frames, float gain_from, float gain_to) {
+    const float step = (gain_to - gain_from) / (float)(frames ? frames : 1);
+    for (size_t i = 0; i < frames; ++i) {
+        const float g = gain_from + step * (float)(i + 1);
+        dst[i * 2] += src[i * 2] * g;
+        dst[i * 2 + 1] += src[i * 2 + 1] * g;
+    }
+}
+
+// dst += src, for summing partial mixes
+inline void audioAccumulate(float* dst, const float* src, size_t count) {
+    size_t i = 0;
+#ifdef AUDIO_SIMD_X86
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+        _mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_loadu_ps(src + i + 4)));
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+// Ear gains and low-pass coefficient for count 3d emitters at once,
+// positions and the rest split into arrays (the voice table's rows).
+// Per ear: full gain inside radius, inverse square falloff past it.
+// Air absorption: the one-pole coefficient is 1 (no filtering) inside
+// radius and 1 / (1 + absorption * radii past it) beyond.
+// gain is the voice gain, out_l/out_r include audioMixGain()
+inline void audioSpatialGains(
+    const float* x, const float* y, const float* z, const float* radius, const float* gain, size_t count,
+    const float* ear_l, const float* ear_r, float absorption,
+    float* out_l, float* out_r, float* out_lowpass
+) {
+    size_t i = 0;
+#ifdef AUDIO_SIMD_X86
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(1.0f / 32767.0f);
+    const __m128 tiny = _mm_set1_ps(1e-6f);
+    const __m128 absorb = _mm_set1_ps(absorption);
+    for (; i + 4 <= count; i += 4) {
+        const __m128 px = _mm_loadu_ps(x + i);
+        const __m128 py = _mm_loadu_ps(y + i);
+        const __m128 pz = _mm_loadu_ps(z + i);
+        const __m128 inv_r = _mm_div_ps(one, _mm_max_ps(_mm_loadu_ps(radius + i), tiny));
+        const __m128 inv_r2 = _mm_mul_ps(inv_r, inv_r);
+        const __m128 g = _mm_mul_ps(_mm_loadu_ps(gain + i), scale);
+
+        __m128 dx = _mm_sub_ps(px, _mm_set1_ps(ear_l[0]));
+        __m128 dy = _mm_sub_ps(py, _mm_set1_ps(ear_l[1]));
+        __m128 dz = _mm_sub_ps(pz, _mm_set1_ps(ear_l[2]));
+        const __m128 d2l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        dx = _mm_sub_ps(px, _mm_set1_ps(ear_r[0]));
+        dy = _mm_sub_ps(py, _mm_set1_ps(ear_r[1]));
+        dz = _mm_sub_ps(pz, _mm_set1_ps(ear_r[2]));
+        const __m128 d2r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+        // min(1 / (d / r)^2, 1), 1 / 0 is inf and clamps to 1
+        const __m128 fl = _mm_min_ps(_mm_div_ps(one, _mm_mul_ps(d2l, inv_r2)), one);
+        const __m128 fr = _mm_min_ps(_mm_div_ps(one, _mm_mul_ps(d2r, inv_r2)), one);
+        _mm_storeu_ps(out_l + i, _mm_mul_ps(g, fl));
+        _mm_storeu_ps(out_r + i, _mm_mul_ps(g, fr));
+
+        const __m128 radii = _mm_mul_ps(_mm_sqrt_ps(_mm_min_ps(d2l, d2r)), inv_r);
+        const __m128 past = _mm_max_ps(_mm_sub_ps(radii, one), _mm_setzero_ps());
+        _mm_storeu_ps(out_lowpass + i, _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(absorb, past))));
+    }
+#endif
+    for (; i < count; ++i) {
+        const float inv_r = 1.0f / (radius[i] > 1e-6f ? radius[i] : 1e-6f);
+        const float g = gain[i] * (1.0f / 32767.0f);
+        float dx = x[i] - ear_l[0];
+        float dy = y[i] - ear_l[1];
+        float dz = z[i] - ear_l[2];
+        const float d2l = dx * dx + dy * dy + dz * dz;
+        dx = x[i] - ear_r[0];
+        dy = y[i] - ear_r[1];
+        dz = z[i] - ear_r[2];
+        const float d2r = dx * dx + dy * dy + dz * dz;
+        const float fl = 1.0f / (d2l * inv_r * inv_r);
+        const float fr = 1.0f / (d2r * inv_r * inv_r);
+        out_l[i] = g * (fl < 1.0f ? fl : 1.0f);
+        out_r[i] = g * (fr < 1.0f ? fr : 1.0f);
+        const float past = sqrtf(d2l < d2r ? d2l : d2r) * inv_r - 1.0f;
+        out_lowpass[i] = 1.0f / (1.0f + absorption * (past > .0f ? past : .0f));
+    }
+}
+
+// dst += lowpass(src) * gain into interleaved stereo, src being the
+// left channel of an interleaved stereo block (a 3d voice downmixed).
+// The one-pole coefficient and both gains go linearly from their
+// _from to their _to values over the frames, z is the filter state
+// carried from block to block. A coefficient of 1 all the way is just
+// the gain ramp, without the filter's dependency from frame to frame
+inline void audioMixLowpassRampF32(
+    float* dst, const float* src, size_t frames, float& z,
+    float lowpass_from, float lowpass_to, float gain_l_from, float gain_l_to, float gain_r_from, float gain_r_to
+) {
+    const float inv = 1.0f / (float)(frames ? frames : 1);
+    const float a_step = (lowpass_to - lowpass_from) * inv;
+    const float l_step = (gain_l_to - gain_l_from) * inv;
+    const float r_step = (gain_r_to - gain_r_from) * inv;
+    if (lowpass_from == 1.0f && lowpass_to == 1.0f) {
+        for (size_t i = 0; i < frames; ++i) {
+            const float t = (float)(i + 1);
+            dst[i * 2] += src[i * 2] * (gain_l_from + l_step * t);
+            dst[i * 2 + 1] += src[i * 2] * (gain_r_from + r_step * t);
+        }
+        z = frames ? src[(frames - 1) * 2] : z;
+        return;
+    }
+    float y = z;
+    for (size_t i = 0; i < frames; ++i) {
+        const float t = (float)(i + 1);
+        y += (lowpass_from + a_step * t) * (src[i * 2] - y);
+        dst[i * 2] += y * (gain_l_from + l_step * t);
+        dst[i * 2 + 1] += y * (gain_r_from + r_step * t);
+    }
+    // Keeps a decayed state from going denormal
+    z = fabsf(y) < 1e-15f ? .0f : y;
+}
+
+// y += x * h over count complex values in split re/im arrays,
+// the inner loop of frequency domain convolution
+inline void audioComplexMac(float* y_re, float* y_im, const float* x_re, const float* x_im, const float* h_re, const float* h_im, size_t count) {
+    size_t i = 0;
+#ifdef AUDIO_SIMD_X86
+    for (; i + 4 <= count; i += 4) {
+        const __m128 xr = _mm_loadu_ps(x_re + i);
+        const __m128 xi = _mm_loadu_ps(x_im + i);
+        const __m128 hr = _mm_loadu_ps(h_re + i);
+        const __m128 hi = _mm_loadu_ps(h_im + i);
+        const __m128 re = _mm_sub_ps(_mm_mul_ps(xr, hr), _mm_mul_ps(xi, hi));
+        const __m128 im = _mm_add_ps(_mm_mul_ps(xr, hi), _mm_mul_ps(xi, hr));
+        _mm_storeu_ps(y_re + i, _mm_add_ps(_mm_loadu_ps(y_re + i), re));
+        _mm_storeu_ps(y_im + i, _mm_add_ps(_mm_loadu_ps(y_im + i), im));
+    }
+#endif
+    for (; i < count; ++i) {
+        y_re[i] += x_re[i] * h_re[i] - x_im[i] * h_im[i];
+        y_im[i] += x_re[i] * h_im[i] + x_im[i] * h_re[i];
+    }
+}
+
+#ifdef AUDIO_SIMD_X86
+
+// SSE2 is always there on x64, this is the baseline
+
+inline __m128 audioLoad4s16_sse2(const short* src) {
+    __m128i s = _mm_loadl_epi64((const __m128i*)src);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+}
+
+inline void audioMixMono_sse2(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    const __m128 g = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m128 s = audioLoad4s16_sse2(src + i);
+        __m128 lo = _mm_unpacklo_ps(s, s); // s0 s0 s1 s1
+        __m128 hi = _mm_unpackhi_ps(s, s); // s2 s2 s3 s3
+        float* d = dst + i * 2;
+        _mm_storeu_ps(d,     _mm_add_ps(_mm_loadu_ps(d),     _mm_mul_ps(lo, g)));
+        _mm_storeu_ps(d + 4, _mm_add_ps(_mm_loadu_ps(d + 4), _mm_mul_ps(hi, g)));
+    }
+    audioMixMono_scalar(dst + i * 2, src + i, frames - i, gain_l, gain_r);
+}
+inline void audioMixStereo_sse2(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    const __m128 g = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m128 a = audioLoad4s16_sse2(src + i * 2);
+        __m128 b = audioLoad4s16_sse2(src + i * 2 + 4);
+        float* d = dst + i * 2;
+        _mm_storeu_ps(d,     _mm_add_ps(_mm_loadu_ps(d),     _mm_mul_ps(a, g)));
+        _mm_storeu_ps(d + 4, _mm_add_ps(_mm_loadu_ps(d + 4), _mm_mul_ps(b, g)));
+    }
+    audioMixStereo_scalar(dst + i * 2, src + i * 2, frames - i, gain_l, gain_r);
+}
+inline void audioMixStereoDownmix_sse2(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    const __m128 g = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m128 a = audioLoad4s16_sse2(src + i * 2);
+        __m128 b = audioLoad4s16_sse2(src + i * 2 + 4);
+        // L+R lands in both slots of each frame
+        a = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+        b = _mm_add_ps(b, _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 3, 0, 1)));
+        float* d = dst + i * 2;
+        _mm_storeu_ps(d,     _mm_add_ps(_mm_loadu_ps(d),     _mm_mul_ps(a, g)));
+        _mm_storeu_ps(d + 4, _mm_add_ps(_mm_loadu_ps(d + 4), _mm_mul_ps(b, g)));
+    }
+    audioMixStereoDownmix_scalar(dst + i * 2, src + i * 2, frames - i, gain_l, gain_r);
+}
+inline void audioConvert_sse2(float* dst, const short* src, size_t count, float gain) {
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(audioLoad4s16_sse2(src + i), g));
+    }
+    audioConvert_scalar(dst + i, src + i, count - i, gain);
+}
+
+inline void audioMixMonoF32_sse2(float* dst, const float* src, size_t frames, float gain_l, float gain_r) {
+    const __m128 g = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m128 s = _mm_loadu_ps(src + i);
+        float* d = dst + i * 2;
+        _mm_storeu_ps(d,     _mm_add_ps(_mm_loadu_ps(d),     _mm_mul_ps(_mm_unpacklo_ps(s, s), g)));
+        _mm_storeu_ps(d + 4, _mm_add_ps(_mm_loadu_ps(d + 4), _mm_mul_ps(_mm_unpackhi_ps(s, s), g)));
+    }
+    audioMixMonoF32_scalar(dst + i * 2, src + i, frames - i, gain_l, gain_r);
+}
+inline void audioMixStereoF32_sse2(float* dst, const float* src, size_t frames, float gain_l, float gain_r) {
+    const __m128 g = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        float* d = dst + i * 2;
+        _mm_storeu_ps(d, _mm_add_ps(_mm_loadu_ps(d), _mm_mul_ps(_mm_loadu_ps(src + i * 2), g)));
+    }
+    audioMixStereoF32_scalar(dst + i * 2, src + i * 2, frames - i, gain_l, gain_r);
+}
+inline void audioMixStereoDownmixF32_sse2(float* dst, const float* src, size_t frames, float gain_l, float gain_r) {
+    const __m128 g = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        __m128 s = _mm_loadu_ps(src + i * 2);
+        s = _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 3, 0, 1)));
+        float* d = dst + i * 2;
+        _mm_storeu_ps(d, _mm_add_ps(_mm_loadu_ps(d), _mm_mul_ps(s, g)));
+    }
+    audioMixStereoDownmixF32_scalar(dst + i * 2, src + i * 2, frames - i, gain_l, gain_r);
+}
+
+inline __m128i audioDitherNext_sse2(__m128i& x) {
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    return x;
+}
+inline void audioToS16Dither_sse2(short* dst, const float* src, size_t count, AudioDitherState& state) {
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    const __m128 lsb = _mm_set1_ps(1.0f / 4294967296.0f);
+    __m128i x = _mm_load_si128((const __m128i*)state.lanes);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128 d0 = _mm_add_ps(_mm_cvtepi32_ps(audioDitherNext_sse2(x)), _mm_cvtepi32_ps(audioDitherNext_sse2(x)));
+        __m128 d1 = _mm_add_ps(_mm_cvtepi32_ps(audioDitherNext_sse2(x)), _mm_cvtepi32_ps(audioDitherNext_sse2(x)));
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale), _mm_mul_ps(d0, lsb));
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale), _mm_mul_ps(d1, lsb));
+        // Round to nearest, packs saturates to the s16 range
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+    _mm_store_si128((__m128i*)state.lanes, x);
+    audioToS16Dither_scalar(dst + i, src + i, count - i, state);
+}
+
+AUDIO_TARGET_AVX2 inline __m256 audioLoad8s16_avx2(const short* src) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)src)));
+}
+
+AUDIO_TARGET_AVX2 inline void audioMixMono_avx2(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    const __m256 g = _mm256_setr_ps(gain_l, gain_r, gain_l, gain_r, gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 s = audioLoad8s16_avx2(src + i);
+        __m256 lo = _mm256_unpacklo_ps(s, s); // s0 s0 s1 s1 | s4 s4 s5 s5
+        __m256 hi = _mm256_unpackhi_ps(s, s); // s2 s2 s3 s3 | s6 s6 s7 s7
+        __m256 a = _mm256_permute2f128_ps(lo, hi, 0x20);
+        __m256 b = _mm256_permute2f128_ps(lo, hi, 0x31);
+        float* d = dst + i * 2;
+        _mm256_storeu_ps(d,     _mm256_add_ps(_mm256_loadu_ps(d),     _mm256_mul_ps(a, g)));
+        _mm256_storeu_ps(d + 8, _mm256_add_ps(_mm256_loadu_ps(d + 8), _mm256_mul_ps(b, g)));
+    }
+    audioMixMono_sse2(dst + i * 2, src + i, frames - i, gain_l, gain_r);
+}
+AUDIO_TARGET_AVX2 inline void audioMixStereo_avx2(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    const __m256 g = _mm256_setr_ps(gain_l, gain_r, gain_l, gain_r, gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 a = audioLoad8s16_avx2(src + i * 2);
+        __m256 b = audioLoad8s16_avx2(src + i * 2 + 8);
+        float* d = dst + i * 2;
+        _mm256_storeu_ps(d,     _mm256_add_ps(_mm256_loadu_ps(d),     _mm256_mul_ps(a, g)));
+        _mm256_storeu_ps(d + 8, _mm256_add_ps(_mm256_loadu_ps(d + 8), _mm256_mul_ps(b, g)));
+    }
+    audioMixStereo_sse2(dst + i * 2, src + i * 2, frames - i, gain_l, gain_r);
+}
+AUDIO_TARGET_AVX2 inline void audioMixStereoDownmix_avx2(float* dst, const short* src, size_t frames, float gain_l, float gain_r) {
+    const __m256 g = _mm256_setr_ps(gain_l, gain_r, gain_l, gain_r, gain_l, gain_r, gain_l, gain_r);
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 a = audioLoad8s16_avx2(src + i * 2);
+        __m256 b = audioLoad8s16_avx2(src + i * 2 + 8);
+        a = _mm256_add_ps(a, _mm256_permute_ps(a, _MM_SHUFFLE(2, 3, 0, 1)));
+        b = _mm256_add_ps(b, _mm256_permute_ps(b, _MM_SHUFFLE(2, 3, 0, 1)));
+        float* d = dst + i * 2;
+        _mm256_storeu_ps(d,     _mm256_add_ps(_mm256_loadu_ps(d),     _mm256_mul_ps(a, g)));
+        _mm256_storeu_ps(d + 8, _mm256_add_ps(_mm256_loadu_ps(d + 8), _mm256_mul_ps(b, g)));
+    }
+    audioMixStereoDownmix_sse2(dst + i * 2, src + i * 2, frames - i, gain_l, gain_r);
+}
+AUDIO_TARGET_AVX2 inline void audioConvert_avx2(float* dst, const short* src, size_t count, float gain) {
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(audioLoad8s16_avx2(src + i), g));
+    }
+    audioConvert_sse2(dst + i, src + i, count - i, gain);
+}
+
+inline bool audioCpuHasAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) {
+        return false;
+    }
+    // OS has to save ymm state on context switch
+    if ((_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // AUDIO_SIMD_X86
+
+// Picked once on first use
+inline const AudioMixKernels& audioMixKernels() {
+    static const AudioMixKernels kernels = []() -> AudioMixKernels {
+#ifdef AUDIO_SIMD_X86
+        if (audioCpuHasAvx2()) {
+            return AudioMixKernels{
+                "avx2",
+                &audioMixMono_avx2, &audioMixStereo_avx2, &audioMixStereoDownmix_avx2,
+                &audioConvert_avx2,
+                // float paths are load/store bound, sse2 is plenty
+                &audioMixMonoF32_sse2, &audioMixStereoF32_sse2, &audioMixStereoDownmixF32_sse2,
+                &audioToS16Dither_sse2
+            };
+        }
+        return AudioMixKernels{
+            "sse2",
+            &audioMixMono_sse2, &audioMixStereo_sse2, &audioMixStereoDownmix_sse2,
+            &audioConvert_sse2,
+            &audioMixMonoF32_sse2, &audioMixStereoF32_sse2, &audioMixStereoDownmixF32_sse2,
+            &audioToS16Dither_sse2
+        };
+#else
+        return AudioMixKernels{
+            "scalar",
+            &audioMixMono_scalar, &audioMixStereo_scalar, &audioMixStereoDownmix_scalar,
+            &audioConvert_scalar,
+            &audioMixMonoF32_scalar, &audioMixStereoF32_scalar, &audioMixStereoDownmixF32_scalar,
+            &audioToS16Dither_scalar
+        };
+#endif
+    }();
+    return kernels;
+}
+
+#endif
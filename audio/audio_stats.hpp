@@ -0,0 +1,183 @@
+#ifndef AUDIO_STATS_HPP
+#define AUDIO_STATS_HPP
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "../log/log.hpp"
+#include "audio_mixer.hpp"
+
+// Aggregate of AudioBlockStats over one monitor interval
+struct AudioStatsSnapshot {
+    double   seconds = .0;          // covered by the blocks below
+    uint64_t blocks = 0;
+    double   avg_us = .0;           // render time per block
+    double   max_us = .0;
+    double   deadline_us = .0;      // real time length of the longest block
+    uint64_t late_blocks = 0;       // took longer to render than they last
+    uint64_t underruns = 0;         // reported by the backend
+    int      max_voices = 0;
+    int      max_command_depth = 0;
+    float    peak = .0f;            // before the limiter, over 1 means it worked
+    uint64_t dropped = 0;           // block records the monitor didn't get to in time
+};
+
+// Drains the mixer's per-block records on its own thread, logs a
+// summary every interval (a warning if blocks were late or the
+// backend ran dry) and keeps the last interval for getLast().
+// Every interval it also releases the mixer's finished one-shots
+// (AudioMixer::update()) and calls on_interval, for housekeeping
+// that should happen while nothing is played too
+class AudioStatsMonitor {
+    std::thread thread;
+    std::mutex sync;
+    std::condition_variable cv;
+    bool working = false;
+    AudioMixer* mixer = 0;
+    float interval = 10.0f;
+    std::function<void()> on_interval;
+
+    AudioStatsSnapshot last;
+    AudioStatsSnapshot total;
+public:
+    ~AudioStatsMonitor() {
+        stop();
+    }
+
+    void start(AudioMixer* mixer, float interval_seconds = 10.0f, const std::function<void()>& on_interval = std::function<void()>()) {
+        std::unique_lock<std::mutex> lock(sync);
+        if (working) {
+            return;
+        }
+        this->mixer = mixer;
+        interval = interval_seconds;
+        this->on_interval = on_interval;
+        working = true;
+        thread = std::thread([this]() { run(); });
+    }
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(sync);
+            if (!working) {
+                return;
+            }
+            working = false;
+            cv.notify_one();
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    AudioStatsSnapshot getLast() {
+        std::unique_lock<std::mutex> lock(sync);
+        return last;
+    }
+    // Everything since start(), max_* and peak included
+    AudioStatsSnapshot getTotal() {
+        std::unique_lock<std::mutex> lock(sync);
+        return total;
+    }
+private:
+    static void add(AudioStatsSnapshot& s, const AudioBlockStats& b, int sampleRate) {
+        double us = b.process_ns / 1000.0;
+        double deadline = b.frames * 1e6 / sampleRate;
+        s.avg_us = (s.avg_us * s.blocks + us) / (s.blocks + 1);
+        ++s.blocks;
+        s.seconds += (double)b.frames / sampleRate;
+        s.max_us = std::max(s.max_us, us);
+        s.deadline_us = std::max(s.deadline_us, deadline);
+        s.late_blocks += us > deadline ? 1 : 0;
+        s.max_voices = std::max(s.max_voices, (int)b.voices);
+        s.max_command_depth = std::max(s.max_command_depth, (int)b.command_depth);
+        s.peak = std::max(s.peak, b.peak);
+    }
+    static void merge(AudioStatsSnapshot& into, const AudioStatsSnapshot& s) {
+        if (s.blocks) {
+            into.avg_us = (into.avg_us * into.blocks + s.avg_us * s.blocks) / (into.blocks + s.blocks);
+        }
+        into.blocks += s.blocks;
+        into.seconds += s.seconds;
+        into.max_us = std::max(into.max_us, s.max_us);
+        into.deadline_us = std::max(into.deadline_us, s.deadline_us);
+        into.late_blocks += s.late_blocks;
+        into.underruns += s.underruns;
+        into.max_voices = std::max(into.max_voices, s.max_voices);
+        into.max_command_depth = std::max(into.max_command_depth, s.max_command_depth);
+        into.peak = std::max(into.peak, s.peak);
+        into.dropped += s.dropped;
+    }
+
+    void run() {
+        typedef std::chrono::steady_clock clock_t;
+        AudioStatsSnapshot current;
+        AudioBlockStats b;
+        uint64_t underruns_seen = mixer->getBackend() ? mixer->getBackend()->getUnderrunCount() : 0;
+        uint64_t dropped_seen = mixer->getDroppedBlockStats();
+        clock_t::time_point interval_start = clock_t::now();
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(sync);
+                // The record ring holds several seconds of blocks
+                cv.wait_for(lock, std::chrono::milliseconds(250), [this]() { return !working; });
+                if (!working) {
+                    break;
+                }
+            }
+            const int rate = mixer->getSampleRate();
+            while (mixer->popBlockStats(b)) {
+                add(current, b, rate);
+            }
+            if (std::chrono::duration<float>(clock_t::now() - interval_start).count() < interval) {
+                continue;
+            }
+            interval_start = clock_t::now();
+            uint64_t underruns = mixer->getBackend() ? mixer->getBackend()->getUnderrunCount() : 0;
+            uint64_t dropped = mixer->getDroppedBlockStats();
+            current.underruns = underruns - underruns_seen;
+            current.dropped = dropped - dropped_seen;
+            underruns_seen = underruns;
+            dropped_seen = dropped;
+            log(current);
+            {
+                std::unique_lock<std::mutex> lock(sync);
+                last = current;
+                merge(total, current);
+            }
+            current = AudioStatsSnapshot();
+
+            mixer->update();
+            if (on_interval) {
+                on_interval();
+            }
+        }
+    }
+
+    static void log(const AudioStatsSnapshot& s) {
+        char line[256];
+        snprintf(line, sizeof(line),
+            "Audio: %llu blocks, avg %.0f us, max %.0f us of %.0f us, %llu late, %llu underruns, "
+            "voices <= %d, queue <= %d, peak %.2f",
+            (unsigned long long)s.blocks, s.avg_us, s.max_us, s.deadline_us,
+            (unsigned long long)s.late_blocks, (unsigned long long)s.underruns,
+            s.max_voices, s.max_command_depth, s.peak
+        );
+        if (s.late_blocks || s.underruns) {
+            LOG_WARN(line);
+        } else {
+            LOG_DBG(line);
+        }
+    }
+};
+
+inline AudioStatsMonitor& audioStatsMonitor() {
+    static AudioStatsMonitor monitor;
+    return monitor;
+}
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef AUDIO_STREAM_HPP
+#define AUDIO_STREAM_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../log/log.hpp"
+#include "audio_resampler.hpp"
+
+#define STB_VORBIS_HEADER_ONLY
+extern "C" {
+#include "../lib/stb_vorbis.c"
+}
+
+// Bulk single producer/single consumer float ring
+class AudioSampleRing {
+    std::vector<float> data;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{ 0 }; // consumer
+    alignas(64) std::atomic<size_t> tail{ 0 }; // producer
+public:
+    // Rounded up to a power of two
+    void init(size_t capacity) {
+        size_t sz = 1;
+        while (sz < capacity) {
+            sz <<= 1;
+        }
+        data.resize(sz);
+        mask = sz - 1;
+        head = 0;
+        tail = 0;
+    }
+    size_t readable() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+    }
+    size_t writable() const {
+        return data.size() - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+    }
+    size_t write(const float* src, size_t count) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        count = std::min(count, writable());
+        size_t first = std::min(count, data.size() - (t & mask));
+        memcpy(&data[t & mask], src, first * sizeof(float));
+        memcpy(&data[0], src + first, (count - first) * sizeof(float));
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+    size_t read(float* dst, size_t count) {
+        size_t h = head.load(std::memory_order_relaxed);
+        count = std::min(count, readable());
+        size_t first = std::min(count, data.size() - (h & mask));
+        memcpy(dst, &data[h & mask], first * sizeof(float));
+        memcpy(dst + first, &data[0], (count - first) * sizeof(float));
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+};
+
+// Ogg Vorbis decoded incrementally instead of all at once.
+// A background thread (AudioStreamer) decodes and converts to the
+// device rate ahead of playback into a small ring, the audio thread
+// only copies frames out of it. Memory use is constant regardless
+// of clip length
+class AudioStream {
+    static constexpr size_t DECODE_FRAMES = 4096;
+    static constexpr size_t OUT_FRAMES = 1024;
+
+    std::string path;
+    stb_vorbis* vorbis = 0;
+    int n_channels = 0;
+    int src_sample_rate = 0;
+
+    // Decoded source frames, with enough history kept for the resampler
+    std::vector<short> decoded;
+    size_t decoded_frames = 0;
+    AudioResampler resampler;
+    uint64_t pos = 0;
+    std::vector<float> out;
+    bool eof = false;
+    bool loop_had_frames = false;
+
+    AudioSampleRing ring;
+    std::atomic<bool> looping{ false };
+    std::atomic<bool> decoder_done{ false };
+    std::mutex refill_sync;
+
+    template<int CHANNELS>
+    size_t resample(size_t n) {
+        return audioResample<CHANNELS, false>(resampler, out.data(), n, decoded.data(), decoded_frames, pos);
+    }
+public:
+    ~AudioStream() {
+        if (vorbis) {
+            stb_vorbis_close(vorbis);
+        }
+    }
+
+    // Reads the headers, nothing is decoded yet. Blocks on the disk,
+    // AudioStreamer::open() does it and the first refill() off the
+    // calling thread. rate other than 1 plays it faster (higher) or
+    // slower (lower), like a buffer voice's rate
+    bool open(const char* path, int dstSampleRate, float rate = 1.0f, float buffer_seconds = .5f, AUDIO_RESAMPLE_QUALITY quality = AUDIO_RESAMPLE_SINC) {
+        this->path = path;
+        int error = 0;
+        vorbis = stb_vorbis_open_filename(path, &error, 0);
+        if (!vorbis) {
+            LOG_ERR("Failed to open audio stream '" << path << "': " << error);
+            return false;
+        }
+        stb_vorbis_info info = stb_vorbis_get_info(vorbis);
+        n_channels = info.channels;
+        src_sample_rate = info.sample_rate;
+        if (n_channels != 1 && n_channels != 2) {
+            LOG_ERR("Audio stream '" << path << "' has " << n_channels << " channels, only mono and stereo are supported");
+            return false;
+        }
+
+        resampler.init(src_sample_rate, dstSampleRate, quality, rate);
+        decoded.resize(DECODE_FRAMES * n_channels);
+        out.resize(OUT_FRAMES * n_channels);
+        ring.init((size_t)(buffer_seconds * dstSampleRate) * n_channels);
+        return true;
+    }
+
+    const std::string& getPath() const { return path; }
+    int channelCount() const { return n_channels; }
+    void setLooping(bool v) { looping = v; }
+    bool isLooping() const { return looping; }
+
+    // Streamer thread. Decodes until the ring is full or the file ends
+    void refill() {
+        std::lock_guard<std::mutex> lock(refill_sync);
+        if (!vorbis || decoder_done) {
+            return;
+        }
+        const size_t lookahead = AudioSincTable::TAPS / 2 + 1;
+        while (true) {
+            if (!eof && decoded_frames < DECODE_FRAMES) {
+                int n = stb_vorbis_get_samples_short_interleaved(
+                    vorbis, n_channels,
+                    decoded.data() + decoded_frames * n_channels,
+                    (int)((DECODE_FRAMES - decoded_frames) * n_channels)
+                );
+                if (n > 0) {
+                    decoded_frames += n;
+                    loop_had_frames = true;
+                } else if (looping && loop_had_frames) {
+                    // Continue from the start, the resampler doesn't
+                    // see the seam so the loop is gapless
+                    stb_vorbis_seek_start(vorbis);
+                    loop_had_frames = false;
+                } else {
+                    eof = true;
+                }
+            }
+
+            // Output frames that can be made without running into
+            // not yet decoded source frames
+            uint64_t limit = 0;
+            if (eof) {
+                limit = (uint64_t)decoded_frames << AUDIO_FRAC_BITS;
+            } else if (decoded_frames > lookahead) {
+                limit = (uint64_t)(decoded_frames - lookahead) << AUDIO_FRAC_BITS;
+            }
+            size_t producible = pos < limit ? (size_t)((limit - pos + resampler.step - 1) / resampler.step) : 0;
+            size_t n = std::min(std::min(producible, ring.writable() / n_channels), OUT_FRAMES);
+            if (n == 0) {
+                if (eof && producible == 0) {
+                    decoder_done = true;
+                    break;
+                }
+                if (ring.writable() < (size_t)n_channels) {
+                    break;
+                }
+                if (!eof && decoded_frames < DECODE_FRAMES) {
+                    continue;
+                }
+                break;
+            }
+
+            size_t written = n_channels == 2 ? resample<2>(n) : resample<1>(n);
+            ring.write(out.data(), written * n_channels);
+
+            // Drop what the resampler is done with, keep a window of history
+            size_t consumed = (size_t)(pos >> AUDIO_FRAC_BITS);
+            size_t drop = consumed > (size_t)AudioSincTable::TAPS ? consumed - AudioSincTable::TAPS : 0;
+            drop = std::min(drop, decoded_frames);
+            if (drop) {
+                memmove(decoded.data(), decoded.data() + drop * n_channels, (decoded_frames - drop) * n_channels * sizeof(short));
+                decoded_frames -= drop;
+                pos -= (uint64_t)drop << AUDIO_FRAC_BITS;
+            }
+        }
+    }
+
+    // Audio thread. Interleaved frames at the device rate, native channel count.
+    // Returns less than requested on underrun or at the end
+    size_t read(float* dst, size_t frames) {
+        return ring.read(dst, frames * n_channels) / n_channels;
+    }
+    bool isFinished() const {
+        return decoder_done && ring.readable() == 0;
+    }
+};
+
+// Keeps every live stream's ring topped up from a single background thread
+class AudioStreamer {
+public:
+    // Called on the streamer thread, stream is null if it failed to open
+    typedef std::function<void(const std::shared_ptr<AudioStream>&)> callback_t;
+private:
+    struct OpenRequest {
+        std::string path;
+        int sample_rate;
+        float rate;
+        callback_t cb;
+    };
+
+    std::thread thread;
+    std::mutex sync;
+    std::condition_variable cv;
+    std::vector<std::weak_ptr<AudioStream>> streams;
+    std::vector<OpenRequest> opening;
+    bool working = false;
+    bool wake_requested = false;
+public:
+    ~AudioStreamer() {
+        stop();
+    }
+
+    // Opens the file and decodes the first chunk here rather than on
+    // the caller's thread, the callback gets a stream ready to play.
+    // Still pending on stop() is dropped without calling back
+    void open(const std::string& path, int dstSampleRate, float rate, const callback_t& cb) {
+        std::unique_lock<std::mutex> lock(sync);
+        start();
+        opening.push_back(OpenRequest{ path, dstSampleRate, rate, cb });
+        wake_requested = true;
+        cv.notify_one();
+    }
+    void add(const std::shared_ptr<AudioStream>& stream) {
+        std::unique_lock<std::mutex> lock(sync);
+        start();
+        streams.push_back(stream);
+        wake_requested = true;
+        cv.notify_one();
+    }
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(sync);
+            if (!working) {
+                return;
+            }
+            working = false;
+            opening.clear();
+            cv.notify_one();
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+private:
+    void start() {
+        if (!working) {
+            working = true;
+            thread = std::thread([this]() { run(); });
+        }
+    }
+    void run() {
+        std::vector<std::shared_ptr<AudioStream>> live;
+        std::vector<OpenRequest> to_open;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(sync);
+                // Rings hold half a second by default, topping up
+                // a few times per ring length is plenty
+                cv.wait_for(lock, std::chrono::milliseconds(50), [this]() { return !working || wake_requested; });
+                if (!working) {
+                    break;
+                }
+                wake_requested = false;
+                to_open.swap(opening);
+                live.clear();
+                for (size_t i = 0; i < streams.size();) {
+                    std::shared_ptr<AudioStream> s = streams[i].lock();
+                    if (!s || s->isFinished()) {
+                        streams[i] = streams.back();
+                        streams.pop_back();
+                        continue;
+                    }
+                    live.push_back(s);
+                    ++i;
+                }
+            }
+            // Callbacks run unlocked, they usually add() the stream
+            for (auto& rq : to_open) {
+                std::shared_ptr<AudioStream> stream(new AudioStream);
+                if (stream->open(rq.path.c_str(), rq.sample_rate, rq.rate)) {
+                    stream->refill();
+                } else {
+                    stream.reset();
+                }
+                rq.cb(stream);
+            }
+            to_open.clear();
+            for (auto& s : live) {
+                s->refill();
+            }
+            live.clear();
+        }
+    }
+};
+
+inline AudioStreamer& audioStreamer() {
+    static AudioStreamer streamer;
+    return streamer;
+}
+
+#endif
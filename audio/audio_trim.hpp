@@ -0,0 +1,89 @@
+#ifndef AUDIO_TRIM_HPP
+#define AUDIO_TRIM_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+#include <memory>
+
+#include "audio_buffer.hpp"
+
+// Silence cut off the ends of a clip when it's loaded, so playback
+// starts on the first audible sample and the voice is freed after
+// the last one. pad_seconds of the quiet part are kept at each end,
+// a fade-in or the tail of a decay sits just under any threshold
+struct AudioTrimConfig {
+    bool  enabled = true;
+    float threshold_db = -50.0f;    // dBFS, samples at or under it count as silence
+    float pad_seconds = .005f;
+};
+
+// Frames removed from the start and the end
+struct AudioTrim {
+    size_t lead_frames = 0;
+    size_t tail_frames = 0;
+};
+
+template<typename T>
+AudioTrim audioFindTrim(const T* samples, size_t frames, int channels, int sampleRate, T threshold, const AudioTrimConfig& cfg) {
+    AudioTrim r;
+    if (!cfg.enabled || !frames || channels < 1) {
+        return r;
+    }
+    const size_t count = frames * channels;
+    size_t first = 0;
+    while (first < count && samples[first] <= threshold && samples[first] >= -threshold) {
+        ++first;
+    }
+    if (first == count) {
+        // All silence, left alone rather than made empty
+        return r;
+    }
+    size_t last = count - 1;
+    while (samples[last] <= threshold && samples[last] >= -threshold) {
+        --last;
+    }
+    const size_t pad = (size_t)(cfg.pad_seconds * sampleRate);
+    const size_t first_frame = first / channels;
+    const size_t last_frame = last / channels;
+    r.lead_frames = first_frame > pad ? first_frame - pad : 0;
+    r.tail_frames = frames - 1 - std::min(frames - 1, last_frame + pad);
+    return r;
+}
+
+inline AudioTrim audioFindTrim(AudioBuffer* buf, const AudioTrimConfig& cfg) {
+    const size_t frames = buf->sampleCount() / buf->channelCount();
+    const float threshold = powf(10.0f, cfg.threshold_db / 20.0f);
+    if (buf->sampleFormat() == AUDIO_SAMPLE_F32) {
+        return audioFindTrim(buf->getPtrF32(), frames, buf->channelCount(), buf->sampleRate(), threshold, cfg);
+    }
+    return audioFindTrim(buf->getPtr(), frames, buf->channelCount(), buf->sampleRate(), (short)(threshold * 32767.0f), cfg);
+}
+
+// View of buf without the trimmed frames, keeping buf alive.
+// buf itself if there's nothing to trim
+inline std::unique_ptr<AudioBuffer> audioTrimBuffer(std::unique_ptr<AudioBuffer> buf, const AudioTrim& trim) {
+    if (!trim.lead_frames && !trim.tail_frames) {
+        return buf;
+    }
+    const int channels = buf->channelCount();
+    const int rate = buf->sampleRate();
+    const size_t count = buf->sampleCount() - (trim.lead_frames + trim.tail_frames) * channels;
+    std::shared_ptr<AudioBuffer> owner(buf.release());
+    if (owner->sampleFormat() == AUDIO_SAMPLE_F32) {
+        return std::unique_ptr<AudioBuffer>(AudioBuffer::view(
+            owner->getPtrF32() + trim.lead_frames * channels, count, rate, channels, owner
+        ));
+    }
+    return std::unique_ptr<AudioBuffer>(AudioBuffer::view(
+        (const short*)owner->getPtr() + trim.lead_frames * channels, count, rate, channels, owner
+    ));
+}
+
+// Applied by AudioClip::load(), set before clips are loaded
+inline AudioTrimConfig& audioClipTrimConfig() {
+    static AudioTrimConfig cfg;
+    return cfg;
+}
+
+#endif
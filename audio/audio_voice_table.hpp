@@ -0,0 +1,215 @@
+#ifndef AUDIO_VOICE_TABLE_HPP
+#define AUDIO_VOICE_TABLE_HPP
+
+#include <stdint.h>
+#include <vector>
+
+#include "audio_buffer.hpp"
+#include "audio_resampler.hpp"
+#include "audio_command_queue.hpp"
+
+enum AUDIO_VOICE_FLAGS {
+    AUDIO_VOICE_LOOPING = 0x1,
+    AUDIO_VOICE_3D      = 0x2
+};
+
+// Voices owned by the audio thread.
+//
+// Slots are stable ids handed out to channels, one per AudioChannel,
+// and hold the cold state (params while paused, generation).
+// Playing voices live in dense structure-of-arrays rows that the
+// mixer walks linearly; stopping a voice swap-removes its row, so
+// per block cost follows the number of live voices only.
+// Everything is reserved up front, nothing allocates on the audio thread
+class AudioVoiceTable {
+public:
+    struct Slot {
+        AudioVoiceParams params;
+        uint64_t cursor = 0;     // 32.32 source frames, saved while not playing
+        uint32_t generation = 0;
+        int32_t  row = -1;
+        bool     finish_pending = false;
+    };
+
+    // Rows
+    std::vector<uint32_t>       slot;
+    std::vector<AudioBuffer*>   buf;
+    std::vector<AudioStream*>   stream;
+    std::vector<uint64_t>       cursor; // 32.32 source frames
+    std::vector<AudioResampler> resampler;
+    std::vector<float>          gain;
+    std::vector<float>          pan;
+    std::vector<float>          attenuation_radius;
+    std::vector<float>          pos_x;      // positions split up for audioSpatialGains()
+    std::vector<float>          pos_y;
+    std::vector<float>          pos_z;
+    std::vector<uint8_t>        flags;
+    std::vector<uint8_t>        category;
+    std::vector<int8_t>         priority;
+    std::vector<uint64_t>       start;      // mixer frame clock when it started
+    std::vector<float>          level;      // loudest ear gain last block
+    std::vector<float>          fade;       // 1 unless being stolen
+    std::vector<float>          fade_step;  // per frame, 0 unless being stolen
+    // 3d voices, what the last block ended on. Gains are -1 until
+    // the first block, which starts right at its targets
+    std::vector<float>          spatial_l;
+    std::vector<float>          spatial_r;
+    std::vector<float>          lowpass;    // one-pole coefficient, 1 passes everything
+    std::vector<float>          lowpass_z;  // filter state
+
+    std::vector<Slot>           slots;
+
+    void init(size_t max_voices) {
+        slots.resize(max_voices);
+        slot.reserve(max_voices);
+        buf.reserve(max_voices);
+        stream.reserve(max_voices);
+        cursor.reserve(max_voices);
+        resampler.reserve(max_voices);
+        gain.reserve(max_voices);
+        pan.reserve(max_voices);
+        attenuation_radius.reserve(max_voices);
+        pos_x.reserve(max_voices);
+        pos_y.reserve(max_voices);
+        pos_z.reserve(max_voices);
+        flags.reserve(max_voices);
+        category.reserve(max_voices);
+        priority.reserve(max_voices);
+        start.reserve(max_voices);
+        level.reserve(max_voices);
+        fade.reserve(max_voices);
+        fade_step.reserve(max_voices);
+        spatial_l.reserve(max_voices);
+        spatial_r.reserve(max_voices);
+        lowpass.reserve(max_voices);
+        lowpass_z.reserve(max_voices);
+    }
+
+    size_t size() const { return slot.size(); }
+    bool   isActive(uint32_t s) const { return slots[s].row >= 0; }
+
+    // Slot (re)assigned to a new channel
+    void reset(uint32_t s, uint32_t generation) {
+        deactivate(s);
+        slots[s] = Slot();
+        slots[s].generation = generation;
+    }
+    void activate(uint32_t s) {
+        Slot& sl = slots[s];
+        if (sl.row >= 0) {
+            return;
+        }
+        sl.row = (int32_t)slot.size();
+        slot.push_back(s);
+        buf.push_back(0);
+        stream.push_back(0);
+        cursor.push_back(sl.cursor);
+        resampler.push_back(AudioResampler());
+        gain.push_back(.0f);
+        pan.push_back(.0f);
+        attenuation_radius.push_back(.0f);
+        pos_x.push_back(.0f);
+        pos_y.push_back(.0f);
+        pos_z.push_back(.0f);
+        flags.push_back(0);
+        category.push_back(0);
+        priority.push_back(0);
+        start.push_back(0);
+        level.push_back(.0f);
+        fade.push_back(1.0f);
+        fade_step.push_back(.0f);
+        spatial_l.push_back(-1.0f);
+        spatial_r.push_back(-1.0f);
+        lowpass.push_back(1.0f);
+        lowpass_z.push_back(.0f);
+        writeRow(sl.row, sl.params);
+    }
+    void deactivate(uint32_t s) {
+        Slot& sl = slots[s];
+        if (sl.row < 0) {
+            return;
+        }
+        int32_t row = sl.row;
+        int32_t last = (int32_t)slot.size() - 1;
+        sl.cursor = cursor[row];
+        if (row != last) {
+            slot[row]               = slot[last];
+            buf[row]                = buf[last];
+            stream[row]             = stream[last];
+            cursor[row]             = cursor[last];
+            resampler[row]          = resampler[last];
+            gain[row]               = gain[last];
+            pan[row]                = pan[last];
+            attenuation_radius[row] = attenuation_radius[last];
+            pos_x[row]              = pos_x[last];
+            pos_y[row]              = pos_y[last];
+            pos_z[row]              = pos_z[last];
+            flags[row]              = flags[last];
+            category[row]           = category[last];
+            priority[row]           = priority[last];
+            start[row]              = start[last];
+            level[row]              = level[last];
+            fade[row]               = fade[last];
+            fade_step[row]          = fade_step[last];
+            spatial_l[row]          = spatial_l[last];
+            spatial_r[row]          = spatial_r[last];
+            lowpass[row]            = lowpass[last];
+            lowpass_z[row]          = lowpass_z[last];
+            slots[slot[row]].row = row;
+        }
+        slot.pop_back();
+        buf.pop_back();
+        stream.pop_back();
+        cursor.pop_back();
+        resampler.pop_back();
+        gain.pop_back();
+        pan.pop_back();
+        attenuation_radius.pop_back();
+        pos_x.pop_back();
+        pos_y.pop_back();
+        pos_z.pop_back();
+        flags.pop_back();
+        category.pop_back();
+        priority.pop_back();
+        start.pop_back();
+        level.pop_back();
+        fade.pop_back();
+        fade_step.pop_back();
+        spatial_l.pop_back();
+        spatial_r.pop_back();
+        lowpass.pop_back();
+        lowpass_z.pop_back();
+        sl.row = -1;
+    }
+    void setParams(uint32_t s, const AudioVoiceParams& p) {
+        Slot& sl = slots[s];
+        sl.params = p;
+        if (sl.row >= 0) {
+            writeRow(sl.row, p);
+        }
+    }
+    void resetCursor(uint32_t s) {
+        Slot& sl = slots[s];
+        sl.cursor = 0;
+        if (sl.row >= 0) {
+            cursor[sl.row] = 0;
+        }
+    }
+private:
+    void writeRow(int32_t row, const AudioVoiceParams& p) {
+        buf[row] = p.buf;
+        stream[row] = p.stream;
+        resampler[row] = p.resampler;
+        gain[row] = p.volume;
+        pan[row] = p.panning;
+        attenuation_radius[row] = p.attenuation_radius;
+        pos_x[row] = p.pos.x;
+        pos_y[row] = p.pos.y;
+        pos_z[row] = p.pos.z;
+        flags[row] = (p.looping ? AUDIO_VOICE_LOOPING : 0) | (p.is3d ? AUDIO_VOICE_3D : 0);
+        category[row] = p.category;
+        priority[row] = p.priority;
+    }
+};
+
+#endif
@@ -767,6 +767,8 @@ public:
 
 
 class TwitchIrcSocket : public Socket {
+    // Clip loader callbacks reply from their own threads
+    std::mutex msg_send_sync;
     std::queue<std::string> msg_send_queue;
 public:
     void onSocketConnected() override {
@@ -781,6 +783,7 @@ public:
     }
 
     bool sendMessage(const std::string& str) {
+        std::lock_guard<std::mutex> lock(msg_send_sync);
         int len = str.length();
         int at = 0;
         while (at < len) {
@@ -818,9 +821,12 @@ public:
         int iResult = 0;
         do {
             // Send outgoing messages if there are any
-            while (!msg_send_queue.empty()) {
-                sendMessageImpl("milk2b", msg_send_queue.front());
-                msg_send_queue.pop();
+            {
+                std::lock_guard<std::mutex> lock(msg_send_sync);
+                while (!msg_send_queue.empty()) {
+                    sendMessageImpl("milk2b", msg_send_queue.front());
+                    msg_send_queue.pop();
+                }
             }
 
             // Receive
@@ -879,9 +885,18 @@ std::string makeSoundFileList() {
 
 #include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include "audio/audio_clip.hpp"
+#include "audio/audio_clip_cache.hpp"
+#include "audio/audio_clip_loader.hpp"
+#include "audio/audio_stats.hpp"
 
-std::map<std::string, std::shared_ptr<AudioClip>> clips;
+// Filled from the clip loader's workers.
+// Budget is MILKBOT_CLIP_CACHE_MB, 256 MB by default
+AudioClipCache clips;
+// Compressed size in bytes, roughly a minute of typical vorbis
+const long STREAM_CLIP_THRESHOLD = 1024 * 1024;
 
 static std::vector<std::string> banlist = {
     /*
@@ -890,38 +905,195 @@ static std::vector<std::string> banlist = {
     */
 };
 
-bool playSound(TwitchIrcSocket& sock, const IRC_MESSAGE& irc_msg, const std::string& sound_name, bool respond_to_missing_file = true) {
+bool isBanned(const std::string& user) {
     for (int i = 0; i < banlist.size(); ++i) {
-        if (irc_msg.user == banlist[i]) {
-            return false;
+        if (user == banlist[i]) {
+            return true;
         }
     }
+    return false;
+}
+
+// Uncompressed .wav clips are mapped as is, no decoding or cache entry.
+// Empty if there's no such clip, len is the file size
+std::string findSoundClip(const std::string& sound_name, long& len) {
+    std::string path = std::string("data\\") + sound_name + ".ogg";
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        path = std::string("data\\") + sound_name + ".wav";
+        f = fopen(path.c_str(), "rb");
+    }
+    if (!f) {
+        return std::string();
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fclose(f);
+    return path;
+}
+
+// Long .ogg clips (music and such) are streamed, not decoded whole and
+// cached. A .wav of any length is mapped instead
+bool isStreamedClip(const std::string& path, long len) {
+    return len > STREAM_CLIP_THRESHOLD && path.compare(path.size() - 4, 4, ".ogg") == 0;
+}
 
-    auto it = clips.find(sound_name);
-    if (it == clips.end()) {
-        FILE* f = fopen((std::string("data\\") + sound_name + ".ogg").c_str(), "rb");
-        if (!f) {
-            if (respond_to_missing_file) {
-                sock.sendMessageF("%s, can't find sound clip '%s'", irc_msg.user.c_str(), sound_name.c_str());
+// The same clip triggered again within REPEAT_WINDOW_MS plays up to
+// this many cents off, so spamming it doesn't sound like a machine gun.
+// MILKBOT_SND_PITCH_VARIATION, 0 to turn it off
+float snd_pitch_variation_cents = 40.0f;
+const ULONGLONG REPEAT_WINDOW_MS = 2000;
+
+// Rate for a play of sound_name that nobody asked a speed or pitch for
+float soundRepeatRate(const std::string& sound_name) {
+    static std::mutex sync;
+    static std::map<std::string, ULONGLONG> last_played;
+    static std::mt19937 rng(GetTickCount());
+    std::lock_guard<std::mutex> lock(sync);
+    const ULONGLONG now = GetTickCount64();
+    ULONGLONG& last = last_played[sound_name];
+    const bool repeat = last != 0 && now - last < REPEAT_WINDOW_MS;
+    last = now;
+    if (!repeat || snd_pitch_variation_cents <= .0f) {
+        return 1.0f;
+    }
+    std::uniform_real_distribution<float> cents(-snd_pitch_variation_cents, snd_pitch_variation_cents);
+    return audioSemitonesToRate(cents(rng) / 100.0f);
+}
+
+// rate is the playback speed, pitch goes with it like a tape
+bool playSound(TwitchIrcSocket& sock, const IRC_MESSAGE& irc_msg, const std::string& sound_name, bool respond_to_missing_file = true, float rate = 1.0f) {
+    if (isBanned(irc_msg.user)) {
+        return false;
+    }
+
+    std::shared_ptr<AudioClip> cached = clips.find(sound_name);
+    if (cached) {
+        audio().playOnce(audioClipBuffer(cached), .75f * cached->getLoudness().normalizeGain(), .0f, AUDIO_CATEGORY_SFX, 0, rate);
+        return true;
+    }
+
+    long len = 0;
+    std::string path = findSoundClip(sound_name, len);
+    if (path.empty()) {
+        if (respond_to_missing_file) {
+            sock.sendMessageF("%s, can't find sound clip '%s'", irc_msg.user.c_str(), sound_name.c_str());
+        }
+        return false;
+    }
+    std::string user = irc_msg.user;
+    TwitchIrcSocket* psock = &sock;
+    // Streamed clips come at the mixer rate, resampled for rate on the
+    // way. Opening and the first chunk happen on the streamer thread
+    if (isStreamedClip(path, len)) {
+        audioStreamer().open(path, audio().getSampleRate(), audioClampRate(rate), [psock, user, sound_name](const std::shared_ptr<AudioStream>& stream) {
+            if (!stream) {
+                psock->sendMessageF("%s, failed to read sound clip '%s'", user.c_str(), sound_name.c_str());
+                return;
             }
+            audio().playStream(stream, .75f, .0f);
+        });
+        return true;
+    }
+
+    // Reading and decoding happen on the loader's workers, the sound
+    // plays as soon as it's ready. Everyone who asked for it while it
+    // was loading gets their playback
+    audioClipLoader().load(sound_name, path, [psock, user, sound_name, rate](const std::shared_ptr<AudioClip>& clip) {
+        if (!clip) {
+            psock->sendMessageF("%s, failed to read sound clip '%s'", user.c_str(), sound_name.c_str());
+            return;
+        }
+        audio().playOnce(audioClipBuffer(clip), .75f * clip->getLoudness().normalizeGain(), .0f, AUDIO_CATEGORY_SFX, 0, rate);
+        clips.insert(sound_name, clip);
+    });
+    return true;
+}
+
+// !snd a+b+c: clips played back to back, no gaps
+const size_t MAX_SEQUENCE_CLIPS = 8;
+
+struct SoundSequence {
+    std::mutex sync;
+    std::vector<std::shared_ptr<AudioClip>> clips;
+    size_t pending = 0;
+    bool failed = false;
+    float rate = 1.0f;
+};
+
+// Lined up on the mixer's clock. The first one starts a block from
+// now, so its play command can't arrive after its own start time
+void startSoundSequence(const std::vector<std::shared_ptr<AudioClip>>& seq, float rate) {
+    uint64_t t = audio().getSampleTime() + audio().getBuffering().block_frames;
+    for (const std::shared_ptr<AudioClip>& clip : seq) {
+        std::shared_ptr<AudioBuffer> buf = audioClipBuffer(clip);
+        audio().playAt(buf, t, .75f * clip->getLoudness().normalizeGain(), .0f, AUDIO_CATEGORY_SFX, 0, rate);
+        t += audio().getPlayFrames(buf.get(), rate);
+    }
+}
+
+bool playSoundSequence(TwitchIrcSocket& sock, const IRC_MESSAGE& irc_msg, const std::vector<std::string>& names, float rate = 1.0f) {
+    if (isBanned(irc_msg.user)) {
+        return false;
+    }
+    if (names.size() > MAX_SEQUENCE_CLIPS) {
+        sock.sendMessageF("%s, at most %d clips in a row", irc_msg.user.c_str(), (int)MAX_SEQUENCE_CLIPS);
+        return false;
+    }
+
+    std::shared_ptr<SoundSequence> seq(new SoundSequence);
+    seq->clips.resize(names.size());
+    seq->rate = rate;
+    std::vector<std::pair<size_t, std::string>> to_load;
+    for (size_t i = 0; i < names.size(); ++i) {
+        seq->clips[i] = clips.find(names[i]);
+        if (seq->clips[i]) {
+            continue;
+        }
+        long len = 0;
+        std::string path = findSoundClip(names[i], len);
+        if (path.empty()) {
+            sock.sendMessageF("%s, can't find sound clip '%s'", irc_msg.user.c_str(), names[i].c_str());
             return false;
         }
-        fseek(f, 0, SEEK_END);
-        long len = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        std::vector<unsigned char> buffer;
-        buffer.resize(len);
-        fread(buffer.data(), len, 1, f);
-        fclose(f);
-
-        std::shared_ptr<AudioClip> clip(new AudioClip);
-        if (!clip->deserialize(buffer.data(), buffer.size())) {
-            sock.sendMessageF("%s, failed to read sound clip '%s'", irc_msg.user.c_str(), sound_name.c_str());
+        if (isStreamedClip(path, len)) {
+            sock.sendMessageF("%s, '%s' is too long to play in a row", irc_msg.user.c_str(), names[i].c_str());
             return false;
         }
-        it = clips.insert(std::make_pair(sound_name, clip)).first;
+        to_load.push_back(std::make_pair(i, path));
+    }
+    if (to_load.empty()) {
+        startSoundSequence(seq->clips, seq->rate);
+        return true;
+    }
+
+    // Starts once the last missing clip is in
+    seq->pending = to_load.size();
+    std::string user = irc_msg.user;
+    TwitchIrcSocket* psock = &sock;
+    for (const auto& item : to_load) {
+        size_t i = item.first;
+        std::string sound_name = names[i];
+        audioClipLoader().load(sound_name, item.second, [seq, i, psock, user, sound_name](const std::shared_ptr<AudioClip>& clip) {
+            bool ready = false;
+            {
+                std::lock_guard<std::mutex> lock(seq->sync);
+                if (!clip) {
+                    if (!seq->failed) {
+                        psock->sendMessageF("%s, failed to read sound clip '%s'", user.c_str(), sound_name.c_str());
+                    }
+                    seq->failed = true;
+                } else {
+                    seq->clips[i] = clip;
+                    clips.insert(sound_name, clip);
+                }
+                ready = --seq->pending == 0 && !seq->failed;
+            }
+            if (ready) {
+                startSoundSequence(seq->clips, seq->rate);
+            }
+        });
     }
-    audio().playOnce(it->second->getBuffer(), .75f, .0f);
     return true;
 }
 
@@ -943,7 +1115,60 @@ bool ircHandleBotCmd(TwitchIrcSocket& sock, const IRC_MESSAGE& irc_msg, irc_pars
             sock.sendMessageF("%s, please provide a sound clip name", irc_msg.user.c_str());
             return true;
         }
-        playSound(sock, irc_msg, sound_name);
+        // !snd name speed=1.5 pitch=-3: faster by half, three semitones
+        // down from there. Both go through the voice's resampler
+        float rate = 1.0f;
+        bool rate_given = false;
+        while (true) {
+            while (ircParseAccept(ps, ' ')) {}
+            std::string opt;
+            ircParseEatAnyNotOf(ps, opt, " \r\n");
+            if (opt.empty()) {
+                break;
+            }
+            const char* val = 0;
+            float lo = .0f, hi = .0f;
+            bool pitch = false;
+            if (opt.compare(0, 6, "speed=") == 0) {
+                val = opt.c_str() + 6;
+                lo = .5f;
+                hi = 2.0f;
+            } else if (opt.compare(0, 6, "pitch=") == 0) {
+                val = opt.c_str() + 6;
+                lo = -12.0f;
+                hi = 12.0f;
+                pitch = true;
+            }
+            char* end = 0;
+            float x = val ? strtof(val, &end) : .0f;
+            if (!val || end == val || *end != '\0' || !(x >= lo && x <= hi)) {
+                sock.sendMessageF("%s, try speed=0.5..2 or pitch=-12..12 (semitones)", irc_msg.user.c_str());
+                return true;
+            }
+            rate *= pitch ? audioSemitonesToRate(x) : x;
+            rate_given = true;
+        }
+        if (!rate_given) {
+            rate = soundRepeatRate(sound_name);
+        }
+        if (sound_name.find('+') != std::string::npos) {
+            std::vector<std::string> names;
+            size_t from = 0;
+            while (true) {
+                size_t plus = sound_name.find('+', from);
+                std::string name = sound_name.substr(from, plus == std::string::npos ? std::string::npos : plus - from);
+                if (!name.empty()) {
+                    names.push_back(name);
+                }
+                if (plus == std::string::npos) {
+                    break;
+                }
+                from = plus + 1;
+            }
+            playSoundSequence(sock, irc_msg, names, rate);
+            return true;
+        }
+        playSound(sock, irc_msg, sound_name, true, rate);
         return true;
     } else if(cmd == "tts") {
         ircParseAccept(ps, ' ');
@@ -953,9 +1178,30 @@ bool ircHandleBotCmd(TwitchIrcSocket& sock, const IRC_MESSAGE& irc_msg, irc_pars
             sock.sendMessageF("%s, please provide something to say", irc_msg.user.c_str());
             return true;
         }
-        ttsSay(text.c_str());
+        // Through the mixer so the tts bus fader and music ducking apply,
+        // synthesized off this thread
+        bool queued = ttsSynthesize(text.c_str(), [](const std::shared_ptr<AudioBuffer>& speech) {
+            audio().playOnce(speech, 1.0f, .0f, AUDIO_CATEGORY_TTS, 1);
+        });
+        if (!queued) {
+            ttsSay(text.c_str());
+        }
     } else if (cmd == "sndlist") {
         sock.sendMessage(makeSoundFileList());
+    } else if (cmd == "audiostats") {
+        AudioStatsSnapshot last = audioStatsMonitor().getLast();
+        AudioStatsSnapshot total = audioStatsMonitor().getTotal();
+        AudioClipCacheStats cache = clips.getStats();
+        AudioBackend* backend = audio().getBackend();
+        sock.sendMessageF(
+            "audio: last %.0fs avg %.0fus max %.0fus/%.0fus, %llu late, %llu underruns, voices<=%d, peak %.2f | "
+            "since start: %llu late, %llu underruns, queue depth %d | clips: %zu (%zu MB), %llu hits, %llu misses",
+            last.seconds, last.avg_us, last.max_us, last.deadline_us,
+            (unsigned long long)last.late_blocks, (unsigned long long)last.underruns, last.max_voices, last.peak,
+            (unsigned long long)total.late_blocks, (unsigned long long)total.underruns,
+            backend ? backend->getQueueDepth() : 0,
+            cache.count, cache.bytes / (1024 * 1024), (unsigned long long)cache.hits, (unsigned long long)cache.misses
+        );
     } else {
         // Not an existing command, treat as a sound name
         playSound(sock, irc_msg, cmd, false);
@@ -1068,7 +1314,83 @@ bool netCleanup() {
 
 int main() {
 
-    audio().init(48000, 16);
+    // e.g. MILKBOT_AUDIO_OUT=pipe:- to feed the mix to OBS/ffmpeg, see audioCreateBackend().
+    // The console output moves to stderr then, stdout is the pcm alone
+    // MILKBOT_AUDIO_BUFFERING=robust (or low_latency, block=256,depth=3,...),
+    // see audioParseBufferingConfig()
+    AudioBufferingConfig buffering;
+    if (const char* spec = getenv("MILKBOT_AUDIO_BUFFERING")) {
+        audioParseBufferingConfig(spec, buffering);
+    }
+    // MILKBOT_AUDIO_MIX_THREADS=3 mixes on helper threads once there are
+    // hundreds of voices (overlays with the polyphony caps raised)
+    if (const char* n = getenv("MILKBOT_AUDIO_MIX_THREADS")) {
+        AudioParallelMixConfig parallel;
+        parallel.workers = atoi(n);
+        audio().setParallelMix(parallel);
+    }
+    audio().init(48000, 16, audioCreateBackend(getenv("MILKBOT_AUDIO_OUT")), buffering);
+    // MILKBOT_AUDIO_BUSES=music=-6,tts=+2 to balance the categories,
+    // see audioParseBusConfig()
+    if (const char* spec = getenv("MILKBOT_AUDIO_BUSES")) {
+        AudioBusConfig buses[AUDIO_CATEGORY_COUNT];
+        for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+            buses[i] = audio().getBus((AUDIO_CATEGORY)i);
+        }
+        if (audioParseBusConfig(spec, buses)) {
+            for (int i = 0; i < AUDIO_CATEGORY_COUNT; ++i) {
+                audio().setBus((AUDIO_CATEGORY)i, buses[i]);
+            }
+        } else {
+            LOG_ERR("Unknown audio bus spec '" << spec << "'");
+        }
+    }
+    // Clips that were still playing when they were pushed out of the
+    // cache are dropped once they're done
+    audioStatsMonitor().start(&audio(), 10.0f, []() { clips.trim(); });
+    audioClipLoader().init();
+    // Decoded clips, pre-resampled to the mixer rate, survive restarts
+    audioPcmCache().init("cache\\pcm", audio().getSampleRate());
+    if (const char* mb = getenv("MILKBOT_CLIP_CACHE_MB")) {
+        clips.setBudget((size_t)atoi(mb) * 1024 * 1024);
+    }
+    // Same !snd from many viewers at once plays as one louder hit
+    if (const char* ms = getenv("MILKBOT_SND_COALESCE_MS")) {
+        AudioCoalesceConfig coalesce;
+        coalesce.enabled = atoi(ms) > 0;
+        coalesce.window_seconds = atoi(ms) / 1000.0f;
+        audio().setCoalescing(coalesce);
+    }
+    // Repeats of a clip vary in pitch by up to 40 cents,
+    // MILKBOT_SND_PITCH_VARIATION=0 plays them all the same
+    if (const char* cents = getenv("MILKBOT_SND_PITCH_VARIATION")) {
+        snd_pitch_variation_cents = (float)atof(cents);
+    }
+    // Silence at the ends of clips is cut under -50 dBFS,
+    // MILKBOT_SND_TRIM_DB=-60 to change that, =off to keep it
+    if (const char* db = getenv("MILKBOT_SND_TRIM_DB")) {
+        audioClipTrimConfig().enabled = strcmp(db, "off") != 0;
+        if (audioClipTrimConfig().enabled) {
+            audioClipTrimConfig().threshold_db = (float)atof(db);
+        }
+    }
+    // MILKBOT_SND_REVERB=data\reverb\room.ogg puts !snd in that room:
+    // the sfx bus sends to a convolution reverb with the clip as its
+    // impulse response, at -12 dB unless MILKBOT_AUDIO_BUSES says
+    // otherwise (sfx=0:reverb=-6). Loaded untrimmed, the trim would
+    // cut off its pre-delay and tail
+    if (const char* path = getenv("MILKBOT_SND_REVERB")) {
+        std::shared_ptr<AudioClip> ir(new AudioClip);
+        if (ir->loadRaw(path) && audio().setReverb(audioClipBuffer(ir))) {
+            AudioBusConfig sfx = audio().getBus(AUDIO_CATEGORY_SFX);
+            if (sfx.reverb_send_db <= AUDIO_BUS_SEND_OFF_DB) {
+                sfx.reverb_send_db = -12.0f;
+                audio().setBus(AUDIO_CATEGORY_SFX, sfx);
+            }
+        } else {
+            LOG_ERR("Failed to set up the reverb from '" << path << "'");
+        }
+    }
 
     ttsInit();
     //pVoice->Speak(L"Hello", SPF_ASYNC | SPF_IS_NOT_XML, 0);
@@ -1098,13 +1420,18 @@ int main() {
     );
 
     ircsock.runReceiveLoop();
-    
+
+    // Loader and streamer callbacks use the socket and the mixer
+    audioClipLoader().cleanup();
+    audioStreamer().stop();
+
     ircsock.close();
     
     netCleanup();
 
     ttsCleanup();
 
+    audioStatsMonitor().stop();
     audio().cleanup();
     return 0;
 }
\ No newline at end of file
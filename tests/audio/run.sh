@@ -0,0 +1,30 @@
+#!/bin/sh
+# Renders every script here with audio_render and compares it to its
+# golden in golden/. Exits with 1 if any render is off.
+#
+# usage: tests/audio/run.sh <path to audio_render> [--update]
+#   --update rewrites the goldens instead, review the change by ear
+#   before committing them
+
+render="$1"
+if [ -z "$render" ] || [ ! -x "$render" ]; then
+    echo "usage: $0 <path to audio_render> [--update]" >&2
+    exit 2
+fi
+dir=$(cd "$(dirname "$0")" && pwd)
+out=${TMPDIR:-/tmp}/audio_render_$$
+mkdir -p "$out"
+
+failed=0
+for script in "$dir"/*.txt; do
+    name=$(basename "$script" .txt)
+    golden="$dir/golden/$name.wav"
+    if [ "$2" = "--update" ]; then
+        "$render" "$script" "$golden" || failed=1
+    elif ! "$render" "$script" "$out/$name.wav" "$golden"; then
+        echo "FAILED: $name"
+        failed=1
+    fi
+done
+rm -rf "$out"
+exit $failed
@@ -0,0 +1,79 @@
+// Offline mixer benchmark. Links against the same audio/, log/,
+// handle/ and filesystem/ sources as the bot, no device is opened.
+//
+// usage: audio_bench [voices] [seconds] [block_frames] [workers]
+//   voices        voices per case, 128 by default
+//   seconds       audio rendered per case, 1 by default
+//   block_frames  only this block size instead of 64/128/256/512, 0 for all
+//   workers       parallel mix with this many helper threads, and the
+//                 count the serial/parallel comparison asks for (3 if 0)
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+
+#include "../audio/audio_bench.hpp"
+
+int main(int argc, char** argv) {
+    int voices = argc > 1 ? atoi(argv[1]) : 128;
+    float seconds = argc > 2 ? (float)atof(argv[2]) : 1.0f;
+    int only_block = argc > 3 ? atoi(argv[3]) : 0;
+    int workers = argc > 4 ? atoi(argv[4]) : 0;
+    if (voices <= 0 || voices > AUDIO_MAX_VOICES || seconds <= .0f || workers < 0) {
+        fprintf(stderr, "usage: audio_bench [voices 1-%d] [seconds] [block_frames] [workers]\n", AUDIO_MAX_VOICES);
+        return 1;
+    }
+
+    printf("mix kernels: %s, %d voices, %.1f s per case, %d mix workers\n", audioMixKernels().name, voices, seconds, workers);
+    printf("%-20s %6s %10s %9s %9s %9s %9s %6s %10s\n",
+        "case", "block", "ns/s/v", "avg us", "p99 us", "max us", "deadline", "load", "rt voices");
+
+    // Fixed cost per block size: commands, clearing, limiter
+    std::map<int, AudioBenchResult> empty;
+    for (AudioBenchCase c : audioBenchDefaultCases(voices)) {
+        if (only_block && c.block_frames != only_block) {
+            continue;
+        }
+        c.workers = workers;
+        if (!empty.count(c.block_frames)) {
+            AudioBenchCase e = c;
+            e.voices = 0;
+            empty[c.block_frames] = audioBenchRun(e, seconds);
+        }
+        AudioBenchResult r = audioBenchRun(c, seconds);
+        if (c.voices == 0) {
+            // Fixed cost cases, per block rather than per voice
+            const double cost = r.block_avg_us - empty[c.block_frames].block_avg_us;
+            printf("%-20s %6d %10s %9.1f %9.1f %9.1f %9.1f %5.1f%% %10s\n",
+                c.name, c.block_frames, "-",
+                r.block_avg_us, r.block_p99_us, r.block_max_us, r.deadline_us,
+                100.0 * r.block_avg_us / r.deadline_us, "-");
+            printf("%-20s %6s %+10.1f us per block, %.1f%% of the deadline\n", "", "", cost, 100.0 * cost / r.deadline_us);
+            continue;
+        }
+        printf("%-20s %6d %10.2f %9.1f %9.1f %9.1f %9.1f %5.1f%% %10d\n",
+            c.name, c.block_frames, r.ns_per_sample_voice,
+            r.block_avg_us, r.block_p99_us, r.block_max_us, r.deadline_us,
+            100.0 * r.block_avg_us / r.deadline_us,
+            audioBenchMaxVoices(r, empty[c.block_frames]));
+    }
+    printf("rt voices: sustainable with the average block at 50%% of its deadline\n");
+    printf("reverb: every bus sending at -12 dB, cost is over the empty mixer\n");
+
+    // Same load mixed on the backend thread alone and with helpers
+    const int parallel_workers = workers > 0 ? workers : 3;
+    printf("\nserial vs parallel mix, %d workers asked for\n", parallel_workers);
+    printf("%-20s %6s %6s %9s %9s %9s %9s %7s %8s\n",
+        "case", "voices", "block", "serial", "s p99", "parallel", "p p99", "workers", "speedup");
+    for (AudioBenchCase c : audioBenchParallelCases()) {
+        c.workers = 0;
+        AudioBenchResult serial = audioBenchRun(c, seconds);
+        c.workers = parallel_workers;
+        AudioBenchResult parallel = audioBenchRun(c, seconds);
+        printf("%-20s %6d %6d %9.1f %9.1f %9.1f %9.1f %7d %7.2fx\n",
+            c.name, c.voices, c.block_frames,
+            serial.block_avg_us, serial.block_p99_us, parallel.block_avg_us, parallel.block_p99_us,
+            parallel.mix_workers, serial.block_avg_us / parallel.block_avg_us);
+    }
+    printf("block times in us, workers is how many ran (at most cores - 1)\n");
+    return 0;
+}
@@ -0,0 +1,77 @@
+// Deterministic offline render of a mixer script, see AudioRenderScript.
+// Links against the same audio/, log/, handle/ and filesystem/ sources
+// as the bot, no device is opened.
+//
+// usage: audio_render [-r rate] [-b block_frames] <script> <out.wav> [golden.wav [tolerance]]
+//   Renders the script to a 32 bit float wav. With a golden render,
+//   compares the two and exits with 1 if any sample differs by more
+//   than tolerance (1e-4 by default, about 3 LSB at 16 bit)
+//
+// The scripts under tests/audio and their goldens are the regression
+// set, tests/audio/run.sh renders and checks them all
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../audio/audio_render_script.hpp"
+
+int main(int argc, char** argv) {
+    int rate = 48000;
+    int block = 128;
+    const char* args[4] = { 0, 0, 0, 0 };
+    int n_args = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            block = atoi(argv[++i]);
+        } else if (n_args < 4) {
+            args[n_args++] = argv[i];
+        }
+    }
+    if (n_args < 2 || rate <= 0 || block <= 0) {
+        fprintf(stderr, "usage: audio_render [-r rate] [-b block_frames] <script> <out.wav> [golden.wav [tolerance]]\n");
+        return 2;
+    }
+
+    AudioRenderScript script;
+    if (!script.load(args[0])) {
+        return 2;
+    }
+    std::vector<float> out;
+    if (!script.render(rate, block, out)) {
+        return 2;
+    }
+    const int channels = 2;
+    if (!audioWriteWavF32(args[1], out.data(), out.size() / channels, rate, channels)) {
+        return 2;
+    }
+    printf("%s: %.3f s, %d Hz, block %d\n", args[1], script.length(), rate, block);
+    if (!args[2]) {
+        return 0;
+    }
+
+    std::vector<float> golden;
+    int golden_rate = 0;
+    int golden_channels = 0;
+    if (!audioReadWav(args[2], golden, golden_rate, golden_channels)) {
+        return 2;
+    }
+    if (golden_rate != rate || golden_channels != channels) {
+        printf("FAIL: golden is %d Hz %d ch\n", golden_rate, golden_channels);
+        return 1;
+    }
+    double tolerance = args[3] ? atof(args[3]) : 1e-4;
+    AudioRenderDiff d = audioCompareRender(out, golden, channels, tolerance);
+    printf("max diff %g, rms %g, tolerance %g\n", d.max_abs, d.rms, tolerance);
+    if (!d.same_length) {
+        printf("FAIL: length %zu vs golden %zu frames\n", out.size() / channels, golden.size() / channels);
+        return 1;
+    }
+    if (d.first_over >= 0) {
+        printf("FAIL: first over tolerance at frame %lld (%.4f s)\n", d.first_over, d.first_over / (double)rate);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -1,5 +1,11 @@
 #include "tts.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
 #include "log/log.hpp"
 
 
@@ -7,6 +13,19 @@ extern CComModule _Module;
 
 static ISpVoice* pVoice = 0;
 
+// Synthesis for the mixer, see ttsSynthesize()
+struct TtsSynthRequest {
+    std::string text;
+    tts_synth_callback_t cb;
+};
+static std::thread synth_thread;
+static std::mutex synth_sync;
+static std::condition_variable synth_cv;
+static std::deque<TtsSynthRequest> synth_queue;
+static bool synth_working = false;
+
+static void ttsSynthRun(ISpVoice* voice);
+
 bool ttsSetFirstFitNarrator(ISpVoice* voice, const WCHAR* lang) {
     HRESULT hr;
     ISpObjectToken* token = 0;
@@ -54,22 +73,150 @@ bool ttsInit() {
 
     pVoice->SetVolume(100);
 
+    // The worker's voice lives in the worker's apartment, set up there.
+    // Waiting for it here keeps ttsSynthesize() from taking requests
+    // nobody will serve
+    std::unique_lock<std::mutex> lock(synth_sync);
+    bool synth_ready = false;
+    bool synth_done = false;
+    synth_thread = std::thread([&synth_ready, &synth_done]() {
+        ISpVoice* voice = 0;
+        bool ok = SUCCEEDED(::CoInitialize(NULL));
+        if (ok) {
+            ok = SUCCEEDED(CoCreateInstance(CLSID_SpVoice, NULL, CLSCTX_ALL, IID_ISpVoice, (void**)&voice))
+                && ttsSetFirstFitNarrator(voice, L"Language=419");
+            if (ok) {
+                voice->SetVolume(100);
+                // The narrator check speaks asynchronously, be done
+                // with it before the output is switched to a stream
+                voice->WaitUntilDone(INFINITE);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(synth_sync);
+            synth_ready = ok;
+            synth_working = ok;
+            synth_done = true;
+        }
+        synth_cv.notify_all();
+        if (ok) {
+            ttsSynthRun(voice);
+        }
+        if (voice) {
+            voice->Release();
+        }
+        ::CoUninitialize();
+    });
+    synth_cv.wait(lock, [&synth_done]() { return synth_done; });
+    if (!synth_ready) {
+        LOG_ERR("Failed to set up TTS synthesis, tts plays outside the mixer");
+    }
+
     LOG("TTS initialized successfully");
     return true;
 }
 
 void ttsCleanup() {
+    // Pending requests are dropped
+    {
+        std::lock_guard<std::mutex> lock(synth_sync);
+        synth_working = false;
+        synth_queue.clear();
+    }
+    synth_cv.notify_all();
+    if (synth_thread.joinable()) {
+        synth_thread.join();
+    }
+
     pVoice->Release();
     pVoice = 0;
 
     ::CoUninitialize();
 }
 
-void ttsSay(const char* str) {
+static std::wstring ttsWiden(const char* str) {
     std::string s = str;
     int len = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), s.size(), 0, 0);
     std::wstring ws;
     ws.resize(len);
     MultiByteToWideChar(CP_UTF8, 0, s.c_str(), s.size(), (wchar_t*)ws.c_str(), len);
+    return ws;
+}
+
+void ttsSay(const char* str) {
+    std::wstring ws = ttsWiden(str);
     pVoice->Speak(ws.c_str(), SPF_ASYNC | SPF_IS_NOT_XML, 0);
+}
+
+// Blocks until synthesized, which takes a fraction of the speech length
+static std::shared_ptr<AudioBuffer> ttsRender(ISpVoice* voice, const std::wstring& ws) {
+    CSpStreamFormat fmt;
+    CComPtr<IStream> mem;
+    CComPtr<ISpStream> stream;
+    if (FAILED(fmt.AssignFormat(SPSF_48kHz16BitMono))
+        || FAILED(CreateStreamOnHGlobal(NULL, TRUE, &mem))
+        || FAILED(stream.CoCreateInstance(CLSID_SpStream))
+        || FAILED(stream->SetBaseStream(mem, fmt.FormatId(), fmt.WaveFormatExPtr()))
+        || FAILED(voice->SetOutput(stream, TRUE))
+    ) {
+        LOG_ERR("Failed to set up TTS output stream");
+        return std::shared_ptr<AudioBuffer>();
+    }
+    HRESULT hr = voice->Speak(ws.c_str(), SPF_IS_NOT_XML, 0);
+    // Back to the default device, for the fallback
+    voice->SetOutput(NULL, TRUE);
+    stream->Close();
+    if (FAILED(hr)) {
+        LOG_ERR("TTS failed to speak");
+        return std::shared_ptr<AudioBuffer>();
+    }
+
+    HGLOBAL hg = 0;
+    STATSTG stat;
+    if (FAILED(GetHGlobalFromStream(mem, &hg)) || FAILED(mem->Stat(&stat, STATFLAG_NONAME))) {
+        return std::shared_ptr<AudioBuffer>();
+    }
+    size_t size = (size_t)stat.cbSize.QuadPart & ~(size_t)1;
+    const void* pcm = GlobalLock(hg);
+    if (!pcm || size == 0) {
+        GlobalUnlock(hg);
+        return std::shared_ptr<AudioBuffer>();
+    }
+    std::shared_ptr<AudioBuffer> buf(new AudioBuffer(pcm, size, fmt.WaveFormatExPtr()->nSamplesPerSec, 1));
+    GlobalUnlock(hg);
+    return buf;
+}
+
+static void ttsSynthRun(ISpVoice* voice) {
+    while (true) {
+        TtsSynthRequest rq;
+        {
+            std::unique_lock<std::mutex> lock(synth_sync);
+            synth_cv.wait(lock, []() { return !synth_working || !synth_queue.empty(); });
+            if (!synth_working) {
+                break;
+            }
+            rq = std::move(synth_queue.front());
+            synth_queue.pop_front();
+        }
+        std::wstring ws = ttsWiden(rq.text.c_str());
+        if (std::shared_ptr<AudioBuffer> speech = ttsRender(voice, ws)) {
+            rq.cb(speech);
+        } else {
+            // Synchronous, the voice is idle again before the next render
+            voice->Speak(ws.c_str(), SPF_IS_NOT_XML, 0);
+        }
+    }
+}
+
+bool ttsSynthesize(const char* str, const tts_synth_callback_t& cb) {
+    {
+        std::lock_guard<std::mutex> lock(synth_sync);
+        if (!synth_working) {
+            return false;
+        }
+        synth_queue.push_back(TtsSynthRequest{ str, cb });
+    }
+    synth_cv.notify_one();
+    return true;
 }
\ No newline at end of file
@@ -6,8 +6,22 @@
 #include "sapi.h"
 #include "sphelper.h"
 
+#include <functional>
+#include <memory>
+
+#include "audio/audio_buffer.hpp"
+
 
 bool ttsInit();
 void ttsCleanup();
 
+// Straight to the default device, outside the mixer
 void ttsSay(const char* str);
+
+// Called on the tts worker thread with 48kHz mono speech
+typedef std::function<void(const std::shared_ptr<AudioBuffer>&)> tts_synth_callback_t;
+// Speech for the mixer's tts bus. Synthesized on a worker thread with
+// a voice of its own, requests are handled in order. If synthesis
+// fails the worker speaks the text to the default device instead and
+// cb isn't called. false if there is no worker, use ttsSay()
+bool ttsSynthesize(const char* str, const tts_synth_callback_t& cb);